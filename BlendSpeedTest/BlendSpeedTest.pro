@@ -0,0 +1,16 @@
+TEMPLATE = app
+TARGET = BlendSpeedTest
+QT += core gui
+
+#Release debugging
+#QMAKE_CXXFLAGS_RELEASE = $$QMAKE_CFLAGS_RELEASE_WITH_DEBUGINFO
+#QMAKE_LFLAGS_RELEASE = $$QMAKE_LFLAGS_RELEASE_WITH_DEBUGINFO
+
+# C++14 support
+QMAKE_CXXFLAGS += -std=c++14
+
+SOURCES += main.cpp
+
+#Code being tested
+SOURCES += ../src/ImageReader/AnimCombiner.cpp
+SOURCES += ../src/ImageReader/BlendKernels.cpp
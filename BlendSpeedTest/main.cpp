@@ -0,0 +1,103 @@
+/*	This file is part of imgviewer, which is free software and is licensed
+ * under the terms of the GNU GPL v3.0. (see http://www.gnu.org/licenses/ ) */ 
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QPainter>
+#include <QDebug>
+#include <algorithm>
+#include <functional>
+
+#include "../src/ImageReader/AnimCombiner.hpp"
+#include "../src/ImageReader/BlendKernels.hpp"
+
+inline int printError( const char* const err, int error_code=-1 ){
+	qDebug( err );
+	return error_code;
+}
+
+/** Runs 'func' several times and prints the average time */
+static void timeIt( QString name, int trials, std::function<void()> func ){
+	QElapsedTimer t;
+	t.start();
+	for( int i=0; i<trials; i++ )
+		func();
+	qDebug() << name << "average:" << ( double(t.nsecsElapsed()) / trials / 1000000 ) << "ms";
+}
+
+/** Frame with a mix of opaque, transparent and translucent pixels, like a typical animation */
+static QImage createArgbFrame( QSize size ){
+	QImage img( size, QImage::Format_ARGB32 );
+	for( int iy=0; iy<img.height(); iy++ ){
+		auto row = reinterpret_cast<QRgb*>( img.scanLine( iy ) );
+		for( int ix=0; ix<img.width(); ix++ ){
+			auto alpha = ( (ix / 32 + iy / 32) % 2 ) ? 255 : 0;
+			if( ix % 97 == 0 )
+				alpha = 128; //Anti-aliased edges
+			row[ix] = qRgba( ix, iy, ix+iy, alpha );
+		}
+	}
+	return img;
+}
+
+static QImage createIndexedFrame( QSize size, const QVector<QRgb>& palette ){
+	QImage img( size, QImage::Format_Indexed8 );
+	img.setColorTable( palette );
+	for( int iy=0; iy<img.height(); iy++ ){
+		auto row = img.scanLine( iy );
+		for( int ix=0; ix<img.width(); ix++ )
+			row[ix] = ( (ix / 16 + iy / 16) % 3 == 0 ) ? 0 : (ix ^ iy) % palette.size(); //0 is transparent
+	}
+	return img;
+}
+
+int main( int argc, char* argv[] ){
+	QCoreApplication app( argc, argv );
+	auto args = app.arguments();
+	
+	if( args.size() < 3 )
+		return printError( "BlendSpeedTest WIDTH HEIGHT [TRIALS]" );
+	QSize size( args[1].toInt(), args[2].toInt() );
+	int trials = args.size() > 3 ? std::max( args[3].toInt(), 1 ) : 100;
+	if( size.isEmpty() )
+		return printError( "Invalid size" );
+	
+	//Reference, the old QPainter based composition
+	auto argb = createArgbFrame( size );
+	QImage canvas( size, QImage::Format_ARGB32 );
+	canvas.fill( qRgba( 0,0,0,0 ) );
+	timeIt( "QPainter ARGB", trials, [&](){
+			QImage output = canvas;
+			QPainter painter( &output );
+			painter.drawImage( 0, 0, argb );
+		} );
+	
+	QVector<QRgb> palette;
+	for( int i=0; i<256; i++ )
+		palette.push_back( qRgb( i, 255-i, i/2 ) );
+	auto indexed = createIndexedFrame( size, palette );
+	QImage indexed_canvas( size, QImage::Format_Indexed8 );
+	indexed_canvas.setColorTable( palette );
+	indexed_canvas.fill( 1 );
+	
+	auto wanted = BlendKernels::best();
+	for( auto level : { BlendKernels::Level::SCALAR, BlendKernels::Level::SSE2, BlendKernels::Level::AVX2 } ){
+		if( static_cast<int>(level) > static_cast<int>(wanted) )
+			break;
+		BlendKernels::setLevel( level );
+		QString name = BlendKernels::name( level );
+		
+		AnimCombiner argb_combiner( canvas );
+		timeIt( name + " ARGB", trials, [&](){
+				argb_combiner.combine( argb, 0, 0, BlendMode::OVERLAY, DisposeMode::REVERT );
+			} );
+		
+		AnimCombiner indexed_combiner( indexed_canvas );
+		indexed_combiner.setBackgroundColor( IndexColor( 1, palette ) );
+		timeIt( name + " indexed", trials, [&](){
+				indexed_combiner.combine( indexed, 0, 0, BlendMode::OVERLAY, DisposeMode::REVERT, IndexColor( 0, palette ) );
+			} );
+	}
+	
+	return 0;
+}
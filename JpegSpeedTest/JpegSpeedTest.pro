@@ -0,0 +1,24 @@
+TEMPLATE = app
+TARGET = JpegSpeedTest
+QT += core gui widgets concurrent
+unix: QT += x11extras
+
+#Release debugging
+#QMAKE_CXXFLAGS_RELEASE = $$QMAKE_CFLAGS_RELEASE_WITH_DEBUGINFO
+#QMAKE_LFLAGS_RELEASE = $$QMAKE_LFLAGS_RELEASE_WITH_DEBUGINFO
+
+# C++14 support
+QMAKE_CXXFLAGS += -std=c++14
+
+SOURCES += main.cpp
+
+#Reader being tested
+SOURCES += ../src/ImageReader/AReader.cpp
+SOURCES += ../src/ImageReader/ReaderJpeg.cpp
+SOURCES += ../src/meta.cpp
+SOURCES += ../src/viewer/imageCache.cpp
+SOURCES += ../src/viewer/colorManager.cpp
+HEADERS += ../src/viewer/imageCache.h
+
+LIBS += -lexif -ljpeg -llcms2
+unix: LIBS += -lxcb
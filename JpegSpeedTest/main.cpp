@@ -0,0 +1,61 @@
+/*	This file is part of imgviewer, which is free software and is licensed
+ * under the terms of the GNU GPL v3.0. (see http://www.gnu.org/licenses/ ) */ 
+
+#include <QApplication>
+#include <QFile>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <algorithm>
+
+#include "../src/ImageReader/ReaderJpeg.hpp"
+#include "../src/viewer/imageCache.h"
+
+inline int printError( const char* const err, int error_code=-1 ){
+	qDebug( err );
+	return error_code;
+}
+
+/** Decodes 'data' several times and prints the average time */
+static bool timeDecoding( const char* name, const ReaderJpeg& reader, const QByteArray& data, int trials ){
+	auto u_data = reinterpret_cast<const uint8_t*>( data.constData() );
+	
+	QElapsedTimer t;
+	double total = 0;
+	for( int i=0; i<trials; i++ ){
+		imageCache cache;
+		t.start();
+		auto err = reader.read( cache, u_data, data.size(), "jpg", CancelToken(), QSize() );
+		auto time = t.elapsed();
+		if( err != AReader::ERROR_NONE || cache.loaded() < 1 )
+			return false;
+		total += time;
+	}
+	
+	qDebug() << name << "average:" << (total / trials) << "ms";
+	return true;
+}
+
+int main( int argc, char* argv[] ){
+	//imageCache needs the screens for color management
+	QApplication app( argc, argv );
+	auto args = app.arguments();
+	
+	if( args.size() < 2 )
+		return printError( "JpegSpeedTest IMAGE_PATH [TRIALS]" );
+	int trials = args.size() > 2 ? std::max( args[2].toInt(), 1 ) : 10;
+	
+	QFile file( args[1] );
+	if( !file.open(QIODevice::ReadOnly) )
+		return printError( "Could not find file" );
+	auto data = file.readAll();
+	qDebug() << "File in bytes:" << data.size();
+	
+	if( !timeDecoding( "Converted rows", ReaderJpeg( false, false ), data, trials ) )
+		return printError( "Could not decode image" );
+	if( !timeDecoding( "Direct output", ReaderJpeg( true, false ), data, trials ) )
+		return printError( "Could not decode image" );
+	if( !timeDecoding( "Parallel", ReaderJpeg( true, true ), data, trials ) )
+		return printError( "Could not decode image" );
+	
+	return 0;
+}
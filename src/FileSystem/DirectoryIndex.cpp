@@ -0,0 +1,201 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "DirectoryIndex.hpp"
+#include "ExtensionChecker.hpp"
+#include "../ImageReader/CancelToken.hpp"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+static const quint32 index_magic = 0x49445849; //"IDXI"
+static const quint32 index_version = 1;
+
+
+DirectoryIndex::DirectoryIndex( QString root, const ExtensionChecker& checker )
+	:	root( QDir( root ).absolutePath() ), checker( checker ) { }
+
+QString DirectoryIndex::indexPath() const{
+	auto hash = QCryptographicHash::hash( root.toUtf8(), QCryptographicHash::Sha1 ).toHex();
+	return QStandardPaths::writableLocation( QStandardPaths::CacheLocation )
+		+ "/directory-index/" + QString::fromLatin1( hash ) + ".idx";
+}
+
+static qint64 modifiedTime( const QFileInfo& info )
+	{ return info.lastModified().toMSecsSinceEpoch(); }
+
+bool DirectoryIndex::load(){
+	QFile file( indexPath() );
+	if( !file.open( QIODevice::ReadOnly ) )
+		return false;
+	
+	QDataStream stream( &file );
+	quint32 magic, version;
+	QString saved_root, formats;
+	stream >> magic >> version;
+	if( magic != index_magic || version != index_version )
+		return false;
+	stream >> saved_root >> formats;
+	if( saved_root != root || formats != checker.id() )
+		return false; //Hash collision, or other supported formats
+	
+	quint32 dir_count;
+	stream >> dir_count;
+	for( quint32 i=0; i<dir_count && stream.status() == QDataStream::Ok; i++ ){
+		QString path;
+		Directory dir;
+		stream >> path >> dir.modified >> dir.hidden;
+		dirs.insert( path, dir );
+	}
+	
+	quint32 entry_count;
+	stream >> entry_count;
+	entries.reserve( entry_count );
+	for( quint32 i=0; i<entry_count && stream.status() == QDataStream::Ok; i++ ){
+		Entry entry;
+		stream >> entry.path >> entry.hidden;
+		entries.push_back( entry );
+	}
+	stream >> order;
+	
+	if( stream.status() != QDataStream::Ok ){
+		dirs.clear();
+		entries.clear();
+		order = "";
+		return false;
+	}
+	return true;
+}
+
+/** Add the files in 'dir' to the index
+ *  @param subtree Scan all sub-directories, instead of only those not in the index */
+bool DirectoryIndex::scan( QString dir, bool hidden, bool subtree, const CancelToken& cancel ){
+	if( cancel.isCancelled() )
+		return false;
+	
+	//Get the time before listing, so changes during the listing are noticed next time
+	dirs.insert( dir, { modifiedTime( QFileInfo( absolute( dir ) ) ), hidden } );
+	
+	auto filters = QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot | QDir::Hidden;
+	QDirIterator it( absolute( dir ), filters );
+	while( it.hasNext() ){
+		it.next();
+		auto info = it.fileInfo();
+		auto path = dir.isEmpty() ? info.fileName() : dir + "/" + info.fileName();
+		bool is_hidden = hidden || info.isHidden();
+		
+		if( info.isDir() ){
+			//Links are not followed, to avoid loops
+			if( !info.isSymLink() && ( subtree || !dirs.contains( path ) ) )
+				if( !scan( path, is_hidden, true, cancel ) )
+					return false;
+		}
+		else if( checker.matches( path ) )
+			entries.push_back( { path, is_hidden } );
+	}
+	return true;
+}
+
+bool DirectoryIndex::update( const CancelToken& cancel ){
+	if( !load() ){
+		dirs.clear();
+		entries.clear();
+		changed = true;
+		return scan( "", false, true, cancel );
+	}
+	
+	//Find the directories which are gone or have changed
+	QStringList removed, modified;
+	for( auto it = dirs.begin(); it != dirs.end(); ++it ){
+		QFileInfo info( absolute( it.key() ) );
+		if( !info.isDir() )
+			removed << it.key();
+		else if( modifiedTime( info ) != it.value().modified )
+			modified << it.key();
+	}
+	if( removed.isEmpty() && modified.isEmpty() )
+		return true;
+	changed = true;
+	
+	//Drop the files directly in changed directories, and everything in removed ones
+	auto parent = []( const QString& path ){
+			int slash = path.lastIndexOf( '/' );
+			return slash < 0 ? QString() : path.left( slash );
+		};
+	auto in_removed = [&]( const QString& path ){
+			for( auto& dir : removed )
+				if( path.startsWith( dir + "/" ) )
+					return true;
+			return false;
+		};
+	
+	QVector<Entry> kept;
+	kept.reserve( entries.size() );
+	for( auto& entry : entries )
+		if( !modified.contains( parent( entry.path ) ) && !in_removed( entry.path ) )
+			kept.push_back( entry );
+	entries = kept;
+	for( auto& dir : removed )
+		dirs.remove( dir );
+	
+	//List them again, including any new sub-directories
+	for( auto& dir : modified )
+		if( !scan( dir, dirs.value( dir ).hidden, false, cancel ) )
+			return false;
+	return true;
+}
+
+QStringList DirectoryIndex::directories() const{
+	QStringList paths;
+	for( auto it = dirs.begin(); it != dirs.end(); ++it )
+		if( !it.key().isEmpty() )
+			paths << absolute( it.key() );
+	return paths;
+}
+
+void DirectoryIndex::setSorted( QVector<Entry> sorted, QString sort_order ){
+	entries = sorted;
+	order = sort_order;
+	changed = false;
+	
+	auto path = indexPath();
+	QDir().mkpath( QFileInfo( path ).absolutePath() );
+	QSaveFile file( path );
+	if( !file.open( QIODevice::WriteOnly ) )
+		return;
+	
+	QDataStream stream( &file );
+	stream << index_magic << index_version << root << checker.id();
+	
+	stream << quint32( dirs.size() );
+	for( auto it = dirs.begin(); it != dirs.end(); ++it )
+		stream << it.key() << it.value().modified << it.value().hidden;
+	
+	stream << quint32( entries.size() );
+	for( auto& entry : entries )
+		stream << entry.path << entry.hidden;
+	stream << order;
+	
+	file.commit();
+}
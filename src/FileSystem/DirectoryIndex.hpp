@@ -0,0 +1,78 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef DIRECTORY_INDEX_HPP
+#define DIRECTORY_INDEX_HPP
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QVector>
+
+class ExtensionChecker;
+class CancelToken;
+
+/** Saved listing of all supported files below a directory, so large trees
+ *  don't have to be walked every time.
+ *  Each directory is saved with its modification time, which changes when
+ *  entries are added, removed or renamed in it. Only the directories where
+ *  it differs are listed again. The files are saved in sorted order, so
+ *  sorting can be skipped when nothing changed. */
+class DirectoryIndex{
+	public:
+		struct Entry{
+			QString path;	//Relative to the root
+			bool hidden;	//The file or a directory containing it is hidden
+		};
+		
+	private:
+		struct Directory{
+			qint64 modified;
+			bool hidden;
+		};
+		
+		QString root;
+		const ExtensionChecker& checker;
+		QHash<QString, Directory> dirs;	//Relative path, "" for the root
+		QVector<Entry> entries;
+		QString order;	//Sort order of 'entries', empty if unsorted
+		bool changed{ false };
+		
+		QString indexPath() const;
+		QString absolute( QString path ) const{ return path.isEmpty() ? root : root + "/" + path; }
+		bool load();
+		bool scan( QString dir, bool hidden, bool subtree, const CancelToken& cancel );
+		
+	public:
+		DirectoryIndex( QString root, const ExtensionChecker& checker );
+		
+		/** Load the saved index and list the directories changed since
+		 *  @return false if cancelled */
+		bool update( const CancelToken& cancel );
+		
+		const QVector<Entry>& files() const{ return entries; }
+		/** @return Absolute paths of all directories below the root, not including the root */
+		QStringList directories() const;
+		bool isSorted( QString sort_order ) const{ return !order.isEmpty() && order == sort_order && !changed; }
+		
+		/** Replace the files with the same files in sorted order and save the index */
+		void setSorted( QVector<Entry> sorted, QString sort_order );
+};
+
+
+#endif
@@ -0,0 +1,329 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "DirectoryWatcher.hpp"
+
+#include <QDirIterator>
+#include <QSocketNotifier>
+#include <QtConcurrent>
+
+#ifdef Q_OS_LINUX
+	#include <sys/inotify.h>
+	#include <unistd.h>
+	#include <cerrno>
+#endif
+
+static const int collect_time = 200; //Milliseconds to wait for more changes
+
+#ifdef Q_OS_LINUX
+	static const quint32 watch_mask = IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_CREATE
+		| IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+#endif
+
+
+DirectoryWatcher::DirectoryWatcher( QObject* parent ) : QObject( parent ){
+	delay.setSingleShot( true );
+	delay.setInterval( collect_time );
+	connect( &delay, SIGNAL( timeout() ), this, SLOT( flush() ) );
+	connect( &fallback, SIGNAL( directoryChanged( QString ) ), this, SLOT( fallbackChanged() ) );
+	
+#ifdef Q_OS_LINUX
+	inotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if( inotify >= 0 ){
+		notifier = new QSocketNotifier( inotify, QSocketNotifier::Read, this );
+		connect( notifier, SIGNAL( activated( int ) ), this, SLOT( readEvents() ) );
+	}
+	else
+		qWarning( "inotify not available, watching directories without details" );
+#endif
+}
+
+DirectoryWatcher::~DirectoryWatcher(){
+	//The walks use the inotify descriptor
+	for( auto it = walks.begin(); it != walks.end(); ++it )
+		it.key()->waitForFinished();
+	
+#ifdef Q_OS_LINUX
+	delete notifier;
+	if( inotify >= 0 )
+		close( inotify );
+#endif
+}
+
+void DirectoryWatcher::watch( QString dir, bool recursive ){
+	clear();
+	root = dir;
+	this->recursive = recursive;
+	
+	if( inotify < 0 ){
+		fallback.addPath( dir );
+		return;
+	}
+	
+	addWatch( dir );
+	adopting = recursive;
+}
+
+QHash<int, QString> DirectoryWatcher::addWatches( const QStringList& dirs ) const{
+	QHash<int, QString> added;
+#ifdef Q_OS_LINUX
+	if( inotify < 0 )
+		return added;
+	
+	for( auto& dir : dirs ){
+		int wd = inotify_add_watch( inotify, QFile::encodeName( dir ).constData(), watch_mask );
+		if( wd >= 0 )
+			added[wd] = dir;
+		else if( errno == ENOSPC ){
+			qWarning( "Out of inotify watches, changes in %s will not be seen", qPrintable( dir ) );
+			break;
+		}
+	}
+#else
+	Q_UNUSED( dirs );
+#endif
+	return added;
+}
+
+void DirectoryWatcher::adoptWatches( const QHash<int, QString>& added, bool current ){
+#ifdef Q_OS_LINUX
+	if( !current ){
+		//Outdated, but don't remove the ones in use, as inotify reuses them for the same directory
+		for( auto it = added.begin(); it != added.end(); ++it )
+			if( !watches.contains( it.key() ) )
+				inotify_rm_watch( inotify, it.key() );
+		return;
+	}
+	
+	for( auto it = added.begin(); it != added.end(); ++it )
+		watches[it.key()] = it.value();
+	adopting = false;
+	replayUnclaimed();
+#else
+	Q_UNUSED( added );
+	Q_UNUSED( current );
+#endif
+}
+
+/** Handle the events which arrived before their watch was adopted */
+void DirectoryWatcher::replayUnclaimed(){
+	auto events = std::move( unclaimed );
+	unclaimed.clear();
+	for( auto& event : events )
+		handleEvent( event.wd, event.mask, event.name );
+}
+
+void DirectoryWatcher::clear(){
+	if( fallback.directories().size() > 0 )
+		fallback.removePaths( fallback.directories() );
+	
+#ifdef Q_OS_LINUX
+	for( auto it = watches.begin(); it != watches.end(); ++it )
+		inotify_rm_watch( inotify, it.key() );
+#endif
+	watches.clear();
+	unclaimed.clear();
+	adopting = false;
+	for( auto it = walks.begin(); it != walks.end(); ++it )
+		it.value().wanted = false;
+	
+	root = "";
+	delay.stop();
+	pending.clear();
+	pending_reset = false;
+}
+
+void DirectoryWatcher::addWatch( QString dir ){
+#ifdef Q_OS_LINUX
+	int wd = inotify_add_watch( inotify, QFile::encodeName( dir ).constData(), watch_mask );
+	if( wd >= 0 )
+		watches[wd] = dir;
+	else if( errno == ENOSPC )
+		qWarning( "Out of inotify watches, changes in %s will not be seen", qPrintable( dir ) );
+#else
+	Q_UNUSED( dir );
+#endif
+}
+
+/** Stop watching 'dir' and everything in it, the watches would keep the old paths if it was moved */
+void DirectoryWatcher::removeWatches( QString dir ){
+	for( auto it = walks.begin(); it != walks.end(); ++it )
+		if( it.value().dir == dir || it.value().dir.startsWith( dir + "/" ) )
+			it.value().wanted = false;
+	
+#ifdef Q_OS_LINUX
+	for( auto it = watches.begin(); it != watches.end(); ){
+		if( it.value() == dir || it.value().startsWith( dir + "/" ) ){
+			inotify_rm_watch( inotify, it.key() );
+			it = watches.erase( it );
+		}
+		else
+			++it;
+	}
+#else
+	Q_UNUSED( dir );
+#endif
+}
+
+/** Start watching a sub-directory which appeared, and report the files already in it.
+ *  A whole tree might have been moved in, so it is walked on another thread */
+void DirectoryWatcher::addDirectory( QString dir ){
+	auto walk = new QFutureWatcher<Subtree>( this );
+	walks[walk] = { dir, true };
+	connect( walk, &QFutureWatcherBase::finished, this, [=](){ subtreeFinished( walk ); } );
+	walk->setFuture( QtConcurrent::run( this, &DirectoryWatcher::walkSubtree, dir ) );
+}
+
+/** Watch 'dir' and its sub-directories, each before it is listed so no file is missed */
+DirectoryWatcher::Subtree DirectoryWatcher::walkSubtree( QString dir ) const{
+	Subtree subtree;
+	subtree.watches = addWatches( { dir } );
+	
+	QDirIterator it( dir, QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot | QDir::Hidden, QDirIterator::Subdirectories );
+	while( it.hasNext() ){
+		auto path = it.next();
+		if( it.fileInfo().isDir() ){
+			auto added = addWatches( { path } );
+			for( auto wd = added.begin(); wd != added.end(); ++wd )
+				subtree.watches[wd.key()] = wd.value();
+		}
+		else
+			subtree.files << path;
+	}
+	return subtree;
+}
+
+void DirectoryWatcher::subtreeFinished( QFutureWatcher<Subtree>* walk ){
+	bool wanted = walks.take( walk ).wanted;
+	auto subtree = walk->result();
+	walk->deleteLater();
+	
+	if( !wanted ){
+		adoptWatches( subtree.watches, false );
+		replayUnclaimed(); //Drops the events which are no longer claimed by anything
+		return;
+	}
+	
+	for( auto it = subtree.watches.begin(); it != subtree.watches.end(); ++it )
+		watches[it.key()] = it.value();
+	for( auto& file : subtree.files )
+		fileEvent( file, true );
+	replayUnclaimed();
+}
+
+void DirectoryWatcher::fileEvent( QString path, bool exists ){
+	pending[path] = exists;
+	schedule();
+}
+
+/** Wait for more changes, but not longer than 'collect_time' after the first one */
+void DirectoryWatcher::schedule(){
+	if( !delay.isActive() )
+		delay.start();
+}
+
+void DirectoryWatcher::readEvents(){
+#ifdef Q_OS_LINUX
+	alignas(struct inotify_event) char buffer[16 * 1024];
+	while( true ){
+		auto length = read( inotify, buffer, sizeof(buffer) );
+		if( length <= 0 )
+			break; //EAGAIN when everything has been read
+		
+		for( char* pos = buffer; pos < buffer + length; ){
+			auto event = reinterpret_cast<const struct inotify_event*>( pos );
+			pos += sizeof(struct inotify_event) + event->len;
+			handleEvent( event->wd, event->mask, event->len > 0 ? QFile::decodeName( event->name ) : QString() );
+		}
+	}
+#endif
+}
+
+void DirectoryWatcher::handleEvent( int wd, quint32 mask, QString name ){
+#ifdef Q_OS_LINUX
+	if( mask & IN_Q_OVERFLOW ){
+		pending_reset = true;
+		schedule();
+		return;
+	}
+	
+	auto dir = watches.value( wd );
+	if( dir.isEmpty() ){
+		//Might be from a watch the listing thread have not handed over yet
+		if( claiming() && !( mask & IN_IGNORED ) )
+			unclaimed.push_back( { wd, mask, name } );
+		return;
+	}
+	
+	if( mask & IN_IGNORED ){
+		watches.remove( wd );
+		return;
+	}
+	
+	//The watched directory itself is gone
+	if( mask & ( IN_DELETE_SELF | IN_MOVE_SELF ) ){
+		if( dir == root ){
+			pending_reset = true;
+			schedule();
+		}
+		return;
+	}
+	
+	auto path = dir + "/" + name;
+	if( mask & IN_ISDIR ){
+		if( !recursive )
+			return;
+		if( mask & ( IN_CREATE | IN_MOVED_TO ) )
+			addDirectory( path );
+		else if( mask & ( IN_DELETE | IN_MOVED_FROM ) ){
+			removeWatches( path );
+			fileEvent( path, false );
+		}
+	}
+	else if( mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) )
+		fileEvent( path, true ); //Creation is ignored, as the file is not complete before it is closed
+	else if( mask & ( IN_DELETE | IN_MOVED_FROM ) )
+		fileEvent( path, false );
+#else
+	Q_UNUSED( wd );
+	Q_UNUSED( mask );
+	Q_UNUSED( name );
+#endif
+}
+
+void DirectoryWatcher::fallbackChanged(){
+	pending_reset = true;
+	schedule();
+}
+
+void DirectoryWatcher::flush(){
+	if( pending_reset ){
+		pending_reset = false;
+		pending.clear();
+		emit reset();
+		return;
+	}
+	
+	QStringList added, removed;
+	for( auto it = pending.begin(); it != pending.end(); ++it )
+		( it.value() ? added : removed ) << it.key();
+	pending.clear();
+	
+	if( !added.isEmpty() || !removed.isEmpty() )
+		emit changed( added, removed );
+}
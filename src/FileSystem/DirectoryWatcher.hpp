@@ -0,0 +1,120 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef DIRECTORY_WATCHER_HPP
+#define DIRECTORY_WATCHER_HPP
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QFileSystemWatcher>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QTimer>
+
+class QSocketNotifier;
+
+/** Reports which files were added to or removed from a directory.
+ *  On Linux inotify tells exactly which files changed, including in
+ *  sub-directories. Elsewhere only the directory itself is watched with
+ *  QFileSystemWatcher, which just tells that something changed.
+ *  Changes are collected for a short while, so a burst of files arrives as
+ *  one update instead of many.
+ *  In recursive mode watch() only watches the top directory, as walking the
+ *  tree is slow. The listing thread adds the rest with addWatches() and
+ *  hands them over with adoptWatches(). Sub-directories which appear later
+ *  are walked on a worker thread the same way. */
+class DirectoryWatcher : public QObject{
+	Q_OBJECT
+	
+	private:
+		QString root;
+		bool recursive{ false };
+		
+		QFileSystemWatcher fallback;
+		int inotify{ -1 };
+		QSocketNotifier* notifier{ nullptr };
+		QHash<int, QString> watches; //Watched directory of each inotify descriptor
+		
+		//Events from watches not adopted yet, replayed once they are
+		struct Event{
+			int wd;
+			quint32 mask;
+			QString name;
+		};
+		QList<Event> unclaimed;
+		bool adopting{ false };
+		
+		//Sub-directories which appeared, being walked on another thread
+		struct Subtree{
+			QHash<int, QString> watches;
+			QStringList files;
+		};
+		struct Walk{
+			QString dir;
+			bool wanted;
+		};
+		QHash<QFutureWatcher<Subtree>*, Walk> walks;
+		Subtree walkSubtree( QString dir ) const;
+		void subtreeFinished( QFutureWatcher<Subtree>* walk );
+		bool claiming() const{ return adopting || !walks.isEmpty(); }
+		void replayUnclaimed();
+		
+		QTimer delay;
+		QMap<QString, bool> pending; //Path and whether it exists now
+		bool pending_reset{ false };
+		
+		void addWatch( QString dir );
+		void addDirectory( QString dir );
+		void removeWatches( QString dir );
+		void fileEvent( QString path, bool exists );
+		void handleEvent( int wd, quint32 mask, QString name );
+		void schedule();
+		
+	private slots:
+		void readEvents();
+		void fallbackChanged();
+		void flush();
+		
+	public:
+		explicit DirectoryWatcher( QObject* parent=nullptr );
+		~DirectoryWatcher();
+		
+		void watch( QString dir, bool recursive );
+		void clear();
+		
+		/** Start watching 'dirs', can be called from any thread
+		 *  @return The watches, which must be given to adoptWatches() */
+		QHash<int, QString> addWatches( const QStringList& dirs ) const;
+		/** Use watches from addWatches(), or remove them if 'current' is false */
+		void adoptWatches( const QHash<int, QString>& added, bool current );
+		
+	signals:
+		/** Absolute paths of files which appeared and disappeared.
+		 *  A file which was overwritten is reported as added.
+		 *  A removed sub-directory is reported as removed, with the files in it. */
+		void changed( QStringList added, QStringList removed );
+		
+		/** What changed is unknown, the whole directory must be listed again */
+		void reset();
+};
+
+
+#endif
@@ -28,6 +28,10 @@ bool ExtensionChecker::ExtensionGroup::matches( const QString& str ) const{
 }
 
 ExtensionChecker::ExtensionChecker( QStringList exts ){
+	auto sorted = exts;
+	sorted.sort();
+	signature = sorted.join( ',' );
+	
 	sort( exts.begin(), exts.end(), []( QString a, QString b ){ return a.size() < b.size(); } );
 	
 	int pos=0;
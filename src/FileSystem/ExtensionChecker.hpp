@@ -39,10 +39,14 @@ class ExtensionChecker{
 				bool matches( const QString& str ) const;
 		};
 		std::vector<ExtensionGroup> groups;
+		QString signature;
 		
 	public:
 		explicit ExtensionChecker( QStringList exts );
 		
+		/** @return Text which is the same for checkers matching the same extensions */
+		QString id() const{ return signature; }
+		
 		bool matches( const QString& str ) const{
 			for( auto& group : groups )
 				if( group.matches( str ) )
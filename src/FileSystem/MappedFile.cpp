@@ -0,0 +1,45 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "MappedFile.hpp"
+
+#include <limits>
+
+MappedFile::MappedFile( QString filepath ) : file( filepath ){
+	if( !file.open( QIODevice::ReadOnly ) )
+		return;
+	
+	//Mappings are only valid while 'file' is open, so keep it open
+	auto file_size = file.size();
+	if( !file.isSequential() && file_size > 0 && file_size <= std::numeric_limits<unsigned>::max() ){
+		auto mapped = file.map( 0, file_size );
+		if( mapped ){
+			ptr = mapped;
+			length = file_size;
+			return;
+		}
+	}
+	
+	//Fall back to a normal read
+	buffer = file.readAll();
+	file.close();
+	if( buffer.isNull() )
+		buffer = QByteArray( "" ); //Still valid, even if empty
+	ptr = reinterpret_cast<const uint8_t*>( buffer.constData() );
+	length = buffer.size();
+}
@@ -0,0 +1,48 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <QFile>
+#include <QByteArray>
+#include <QString>
+
+/** Read-only view of the contents of a file.
+ *  The file is memory mapped when possible, so no copy is made. If it can't
+ *  be mapped (pipes and the like) it is read into memory instead. */
+class MappedFile{
+	private:
+		QFile file;
+		QByteArray buffer; //Only used when mapping fails
+		const uint8_t* ptr{ nullptr };
+		unsigned length{ 0 };
+		
+	public:
+		explicit MappedFile( QString filepath );
+		MappedFile( const MappedFile& copy ) = delete;
+		
+		bool isValid() const{ return ptr != nullptr; }
+		bool isMapped() const{ return buffer.isNull() && isValid(); }
+		
+		const uint8_t* data() const{ return ptr; }
+		unsigned size() const{ return length; }
+};
+
+
+#endif
@@ -17,7 +17,10 @@
 
 #include "AReader.hpp"
 
+#include <cstring>
 
-
-
-
+bool Signature::matches( const uint8_t* data, unsigned length ) const{
+	if( offset + magic.size() > length )
+		return false;
+	return std::memcmp( data + offset, magic.constData(), magic.size() ) == 0;
+}
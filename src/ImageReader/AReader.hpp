@@ -19,10 +19,31 @@
 #define A_READER_HPP
 
 #include "../viewer/imageCache.h"
+#include "CancelToken.hpp"
 
 #include <QString>
 #include <QList>
+#include <QSize>
+#include <QByteArray>
 
+/** Information which can be read from the headers without decoding the image */
+struct ImageInfo{
+	QSize size;
+	int frames{ 0 };	//0 if unknown
+	bool animated{ false };
+	int bit_depth{ 0 };	//Per channel, 0 if unknown
+	Orientation orientation;
+	bool has_profile{ false };	//Contains an embedded color profile
+};
+
+/** Magic bytes which identifies a format */
+struct Signature{
+	unsigned offset;	//Position of 'magic' in the file
+	QByteArray magic;
+	QString format;	//Passed on to read()
+	
+	bool matches( const uint8_t* data, unsigned length ) const;
+};
 
 class AReader{
 	public:
@@ -33,6 +54,7 @@ class AReader{
 			ERROR_FILE_BROKEN,	//Reading initially seemed to be fine, but contained errors
 			ERROR_INITIALIZATION,
 			ERROR_UNSUPPORTED, //File is using an unsupported feature
+			ERROR_CANCELLED, //Reading was aborted by a CancelToken
 			
 			ERROR_CUSTOM,	//Further details in QString list?
 			ERROR_UNKNOWN
@@ -42,12 +64,18 @@ class AReader{
 		
 		
 		virtual QList<QString> extensions() const = 0; // List of extensions files of this type can have
+		virtual QList<Signature> signatures() const{ return {}; } // Magic bytes of the files it supports
 		
 		
 		virtual bool can_read( const uint8_t* data, unsigned length, QString format ) const = 0; //Test if this file can be read
 		
+		virtual Error probe( ImageInfo& info, const uint8_t* data, unsigned length, QString format ) const = 0; //Read headers only
+		virtual QImage thumbnail( const uint8_t*, unsigned, QString ) const{ return {}; } //Embedded preview, if any
+		
 		//virtual bool read( imageCache &cache, QString filepath ){ return false; }
-		virtual Error read( imageCache &cache, const uint8_t* data, unsigned length, QString format ) const = 0;
+		//If 'target' is valid, the image may be decoded at a reduced size as long as it still covers 'target'.
+		//Readers doing so must call imageCache::set_scaled() with the original size.
+		virtual Error read( imageCache &cache, const uint8_t* data, unsigned length, QString format, const CancelToken& cancel, QSize target ) const = 0;
 		
 };
 
@@ -16,9 +16,11 @@
 */
 
 #include "AnimCombiner.hpp"
+#include "BlendKernels.hpp"
 
 #include <stdexcept>
-#include <QPainter>
+#include <algorithm>
+#include <cstring>
 #include <QDebug>
 
 IndexColor::IndexColor( int indexed, const QVector<QRgb>& table ) : hasIndexed(true), indexed(indexed){
@@ -47,17 +49,13 @@ static QSize restrictSize( QSize limit, int x, int y, QSize wanted ){
 		};
 }
 	
-static void copyIndexedImage( QImage& img_dest, int x, int y, QImage img_src ){
+static void copyIndexedImage( QImage& img_dest, int x, int y, const QImage& img_src ){
 	auto size = restrictSize( img_dest.size(), x, y, img_src.size() );
-	for( int iy=0; iy<size.height(); iy++ ){
-		auto in  = img_src .scanLine( iy   );
-		auto out = img_dest.scanLine( iy+y );
-		for( int ix=0; ix<size.width(); ix++ )
-			out[ix+x] = in[ix];
-	}
+	for( int iy=0; iy<size.height(); iy++ )
+		std::memcpy( img_dest.scanLine( iy+y ) + x, img_src.constScanLine( iy ), size.width() );
 }
 	
-static void overlayIndexedImage( QImage& img_dest, int x, int y, QImage img_src, int replace ){
+static void overlayIndexedImage( QImage& img_dest, int x, int y, const QImage& img_src, int replace ){
 	//Just copy if replace id is out of range
 	if( replace < 0 || replace > 255 ){
 		copyIndexedImage( img_dest, x, y, img_src );
@@ -65,26 +63,43 @@ static void overlayIndexedImage( QImage& img_dest, int x, int y, QImage img_src,
 	}
 	
 	auto size = restrictSize( img_dest.size(), x, y, img_src.size() );
-	for( int iy=0; iy<size.height(); iy++ ){
-		auto in  = img_src .scanLine( iy   );
-		auto out = img_dest.scanLine( iy+y );
-		for( int ix=0; ix<size.width(); ix++ )
-			out[ix+x] = (in[ix] != replace) ? in[ix] : out[ix+x];
-	}
+	for( int iy=0; iy<size.height(); iy++ )
+		BlendKernels::overlayIndexed( img_dest.scanLine( iy+y ) + x, img_src.constScanLine( iy ), size.width(), replace );
 }
 
 static void fillIndexedRect( QImage& img_dest, int x, int y, QSize area, int color ){
 	auto size = restrictSize( img_dest.size(), x, y, area );
-	for( int iy=0; iy<size.height(); iy++ ){
-		auto out = img_dest.scanLine( iy+y );
-		for( int ix=0; ix<size.width(); ix++ )
-			out[ix+x] = color;
-	}
+	for( int iy=0; iy<size.height(); iy++ )
+		std::memset( img_dest.scanLine( iy+y ) + x, color, size.width() );
+}
+
+//The functions below require Format_ARGB32 destinations, and ARGB32 or RGB32 sources
+static QRgb* argbRow( QImage& img, int x, int y )
+	{ return reinterpret_cast<QRgb*>( img.scanLine( y ) ) + x; }
+static const QRgb* argbRow( const QImage& img, int y )
+	{ return reinterpret_cast<const QRgb*>( img.constScanLine( y ) ); }
+
+static void copyArgbImage( QImage& img_dest, int x, int y, const QImage& img_src ){
+	auto size = restrictSize( img_dest.size(), x, y, img_src.size() );
+	for( int iy=0; iy<size.height(); iy++ )
+		std::memcpy( argbRow( img_dest, x, iy+y ), argbRow( img_src, iy ), size.width() * sizeof(QRgb) );
+}
+
+static void overlayArgbImage( QImage& img_dest, int x, int y, const QImage& img_src ){
+	auto size = restrictSize( img_dest.size(), x, y, img_src.size() );
+	for( int iy=0; iy<size.height(); iy++ )
+		BlendKernels::overlayArgb( argbRow( img_dest, x, iy+y ), argbRow( img_src, iy ), size.width() );
+}
+
+static void fillArgbRect( QImage& img_dest, int x, int y, QSize area, QRgb color ){
+	auto size = restrictSize( img_dest.size(), x, y, area );
+	for( int iy=0; iy<size.height(); iy++ )
+		std::fill_n( argbRow( img_dest, x, iy+y ), size.width(), color );
 }
 
 QImage AnimCombiner::combineIndexed( QImage new_image, int x, int y, BlendMode blend, DisposeMode dispose, IndexColor transparent ){
-	//Bail if the new image is not indexed
-	if( !isIndexed( new_image ) )
+	//Bail if the new image is not indexed, or we have no index to clear with
+	if( !isIndexed( new_image ) || !background_color.hasIndex() )
 		return {};
 	
 //	qDebug( "Color table size: %d", new_image.colorTable().size() );
@@ -121,6 +136,7 @@ QImage AnimCombiner::combineIndexed( QImage new_image, int x, int y, BlendMode b
 	switch( dispose ){
 		case DisposeMode::NONE: previous = output; break;
 		case DisposeMode::BACKGROUND:
+				previous = output;
 				fillIndexedRect( previous, x, y, new_image.size(), background_color.getIndexed() );
 				//TODO: is buggy if color table changes?
 			break;
@@ -138,40 +154,42 @@ QImage AnimCombiner::combine( QImage new_image, int x, int y, BlendMode blend, D
 		previous.fill( isIndexed(previous) ? background_color.getIndexed() : background_color.getRgb() );
 	}
 	
+	//Only the new image and what the last dispose cleared can have changed
+	auto area = QRect( {x, y}, new_image.size() ) & previous.rect();
+	changed = area | disposed;
+	disposed = ( dispose == DisposeMode::NONE ) ? QRect() : area;
+	
 	//Try to see if we can merge it indexed
 	auto tryIndexed = combineIndexed( new_image, x, y, blend, dispose, transparent );
 	if( !tryIndexed.isNull() )
 		return tryIndexed;
 	
-	//QPainter can't handle indexed images, convert to something it can handle
-	auto fixFormat = []( QImage& img, IndexColor transparent={} ){
-			if( isIndexed( img ) ){
-				if( transparent.hasIndex() && transparent.getIndexed() >= 0 ){
-					auto palette = img.colorTable();
+	//Blend in ARGB32, RGB32 is fine for the new image as it is always opaque
+	auto fixFormat = []( QImage& img, bool allow_rgb, IndexColor transparent={} ){
+			if( isIndexed( img ) && transparent.hasIndex() && transparent.getIndexed() >= 0 ){
+				auto palette = img.colorTable();
+				if( transparent.getIndexed() < palette.size() )
 					palette[transparent.getIndexed()] = qRgba(0,0,0,0);
-					img.setColorTable( palette );
-				}
-				img = img.convertToFormat( QImage::Format_ARGB32 );
+				img.setColorTable( palette );
 			}
+			if( img.format() != QImage::Format_ARGB32 && !( allow_rgb && img.format() == QImage::Format_RGB32 ) )
+				img = img.convertToFormat( QImage::Format_ARGB32 );
 		};
-	fixFormat( new_image, transparent );
-	fixFormat( previous );
+	fixFormat( new_image, true, transparent );
+	fixFormat( previous, false );
 	
 	QImage output = previous;
-	QPainter painter( &output );
-	
 	if( blend == BlendMode::REPLACE )
-		painter.setCompositionMode( QPainter::CompositionMode_Source );
-	painter.drawImage( x, y, new_image );
+		copyArgbImage( output, x, y, new_image );
+	else
+		overlayArgbImage( output, x, y, new_image );
 	
 	switch( dispose ){
 		case DisposeMode::NONE: previous = output; break;
-		case DisposeMode::BACKGROUND:{
+		case DisposeMode::BACKGROUND:
 				previous = output;
-				QPainter canvas_painter( &previous );
-				canvas_painter.setCompositionMode( QPainter::CompositionMode_Source );
-				canvas_painter.fillRect( x, y, new_image.width(), new_image.height(), background_color.getRgb() );
-			} break;
+				fillArgbRect( previous, x, y, new_image.size(), background_color.getRgb() );
+			break;
 		case DisposeMode::REVERT: break;
 	}
 	
@@ -51,6 +51,8 @@ class AnimCombiner{
 	private:
 		QImage previous;
 		IndexColor background_color;
+		QRect changed;	//Area which differs from the last output
+		QRect disposed;	//Area which the last dispose changed
 		
 		QImage combineIndexed( QImage new_image, int x, int y, BlendMode blend, DisposeMode dispose, IndexColor transparent );
 		
@@ -60,6 +62,9 @@ class AnimCombiner{
 		
 		void setBackgroundColor( IndexColor background )
 			{ background_color = background; }
+		
+		/** @return The area where the last combined image differs from the one before */
+		QRect changedArea() const{ return changed; }
 };
 
 
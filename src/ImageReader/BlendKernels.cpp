@@ -0,0 +1,202 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "BlendKernels.hpp"
+
+#include <atomic>
+
+#if defined(__SSE2__) || defined(_M_X64)
+	#define BLEND_KERNELS_SSE2
+	#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+	#define BLEND_KERNELS_AVX2
+	#include <immintrin.h>
+#endif
+
+using namespace BlendKernels;
+
+
+static void overlayIndexedScalar( uint8_t* out, const uint8_t* in, int width, uint8_t transparent ){
+	for( int ix=0; ix<width; ix++ )
+		if( in[ix] != transparent )
+			out[ix] = in[ix];
+}
+
+/** Source-over for a pixel which is not fully opaque or transparent */
+static inline uint32_t blendPixel( uint32_t out, uint32_t in ){
+	uint32_t in_alpha = in >> 24;
+	uint32_t out_alpha = (out >> 24) * (255 - in_alpha) / 255; //What is left visible of 'out'
+	uint32_t alpha = in_alpha + out_alpha;
+	if( alpha == 0 )
+		return 0;
+	
+	auto mix = [=]( int shift ){
+			uint32_t a = (in >> shift) & 0xFF, b = (out >> shift) & 0xFF;
+			return ( (a*in_alpha + b*out_alpha + alpha/2) / alpha ) << shift;
+		};
+	return (alpha << 24) | mix( 16 ) | mix( 8 ) | mix( 0 );
+}
+
+static inline void overlayPixel( uint32_t& out, uint32_t in ){
+	auto alpha = in >> 24;
+	if( alpha == 255 )
+		out = in;
+	else if( alpha != 0 )
+		out = blendPixel( out, in );
+}
+
+static void overlayArgbScalar( uint32_t* out, const uint32_t* in, int width ){
+	for( int ix=0; ix<width; ix++ )
+		overlayPixel( out[ix], in[ix] );
+}
+
+
+#ifdef BLEND_KERNELS_SSE2
+static void overlayIndexedSse2( uint8_t* out, const uint8_t* in, int width, uint8_t transparent ){
+	auto key = _mm_set1_epi8( transparent );
+	int ix = 0;
+	for( ; ix+16<=width; ix+=16 ){
+		auto src = _mm_loadu_si128( (const __m128i*)(in + ix) );
+		auto dst = _mm_loadu_si128( (const __m128i*)(out + ix) );
+		auto keep = _mm_cmpeq_epi8( src, key );
+		auto result = _mm_or_si128( _mm_and_si128( keep, dst ), _mm_andnot_si128( keep, src ) );
+		_mm_storeu_si128( (__m128i*)(out + ix), result );
+	}
+	overlayIndexedScalar( out + ix, in + ix, width - ix, transparent );
+}
+
+static void overlayArgbSse2( uint32_t* out, const uint32_t* in, int width ){
+	auto alpha_mask = _mm_set1_epi32( 0xFF000000 );
+	int ix = 0;
+	for( ; ix+4<=width; ix+=4 ){
+		auto src = _mm_loadu_si128( (const __m128i*)(in + ix) );
+		auto alpha = _mm_and_si128( src, alpha_mask );
+		int opaque = _mm_movemask_epi8( _mm_cmpeq_epi32( alpha, alpha_mask ) );
+		int transparent = _mm_movemask_epi8( _mm_cmpeq_epi32( alpha, _mm_setzero_si128() ) );
+		
+		//Most pixels in animations are either fully opaque or fully transparent
+		if( opaque == 0xFFFF )
+			_mm_storeu_si128( (__m128i*)(out + ix), src );
+		else if( transparent != 0xFFFF )
+			for( int i=0; i<4; i++ )
+				overlayPixel( out[ix+i], in[ix+i] );
+	}
+	overlayArgbScalar( out + ix, in + ix, width - ix );
+}
+#endif
+
+#ifdef BLEND_KERNELS_AVX2
+__attribute__(( target( "avx2" ) ))
+static void overlayIndexedAvx2( uint8_t* out, const uint8_t* in, int width, uint8_t transparent ){
+	auto key = _mm256_set1_epi8( transparent );
+	int ix = 0;
+	for( ; ix+32<=width; ix+=32 ){
+		auto src = _mm256_loadu_si256( (const __m256i*)(in + ix) );
+		auto dst = _mm256_loadu_si256( (const __m256i*)(out + ix) );
+		auto keep = _mm256_cmpeq_epi8( src, key );
+		_mm256_storeu_si256( (__m256i*)(out + ix), _mm256_blendv_epi8( src, dst, keep ) );
+	}
+	overlayIndexedScalar( out + ix, in + ix, width - ix, transparent );
+}
+
+__attribute__(( target( "avx2" ) ))
+static void overlayArgbAvx2( uint32_t* out, const uint32_t* in, int width ){
+	auto alpha_mask = _mm256_set1_epi32( 0xFF000000 );
+	int ix = 0;
+	for( ; ix+8<=width; ix+=8 ){
+		auto src = _mm256_loadu_si256( (const __m256i*)(in + ix) );
+		auto alpha = _mm256_and_si256( src, alpha_mask );
+		unsigned opaque = _mm256_movemask_epi8( _mm256_cmpeq_epi32( alpha, alpha_mask ) );
+		unsigned transparent = _mm256_movemask_epi8( _mm256_cmpeq_epi32( alpha, _mm256_setzero_si256() ) );
+		
+		if( opaque == 0xFFFFFFFF )
+			_mm256_storeu_si256( (__m256i*)(out + ix), src );
+		else if( transparent != 0xFFFFFFFF )
+			for( int i=0; i<8; i++ )
+				overlayPixel( out[ix+i], in[ix+i] );
+	}
+	overlayArgbScalar( out + ix, in + ix, width - ix );
+}
+#endif
+
+
+struct Kernels{
+	Level level;
+	void (*overlayIndexed)( uint8_t*, const uint8_t*, int, uint8_t );
+	void (*overlayArgb)( uint32_t*, const uint32_t*, int );
+};
+
+static const Kernels kernels_scalar = { Level::SCALAR, overlayIndexedScalar, overlayArgbScalar };
+#ifdef BLEND_KERNELS_SSE2
+static const Kernels kernels_sse2 = { Level::SSE2, overlayIndexedSse2, overlayArgbSse2 };
+#endif
+#ifdef BLEND_KERNELS_AVX2
+static const Kernels kernels_avx2 = { Level::AVX2, overlayIndexedAvx2, overlayArgbAvx2 };
+#endif
+
+static const Kernels* kernelsFor( Level level ){
+	switch( level ){
+#ifdef BLEND_KERNELS_AVX2
+		case Level::AVX2: return &kernels_avx2;
+#endif
+#ifdef BLEND_KERNELS_SSE2
+		case Level::SSE2: return &kernels_sse2;
+#endif
+		default: return &kernels_scalar;
+	}
+}
+
+Level BlendKernels::best(){
+#ifdef BLEND_KERNELS_AVX2
+	if( __builtin_cpu_supports( "avx2" ) )
+		return Level::AVX2;
+#endif
+#ifdef BLEND_KERNELS_SSE2
+	return Level::SSE2;
+#else
+	return Level::SCALAR;
+#endif
+}
+
+/** The tables are constant, so switching the pointer is safe while other threads are decoding */
+static std::atomic<const Kernels*>& current(){
+	static std::atomic<const Kernels*> kernels{ kernelsFor( best() ) };
+	return kernels;
+}
+
+Level BlendKernels::level(){ return current().load()->level; }
+
+void BlendKernels::setLevel( Level wanted ){
+	current() = kernelsFor( static_cast<int>(wanted) < static_cast<int>(best()) ? wanted : best() );
+}
+
+const char* BlendKernels::name( Level level ){
+	switch( level ){
+		case Level::SCALAR: return "Scalar";
+		case Level::SSE2:   return "SSE2";
+		case Level::AVX2:   return "AVX2";
+		default: return "Unknown";
+	}
+}
+
+void BlendKernels::overlayIndexed( uint8_t* out, const uint8_t* in, int width, uint8_t transparent )
+	{ current().load( std::memory_order_relaxed )->overlayIndexed( out, in, width, transparent ); }
+
+void BlendKernels::overlayArgb( uint32_t* out, const uint32_t* in, int width )
+	{ current().load( std::memory_order_relaxed )->overlayArgb( out, in, width ); }
@@ -0,0 +1,46 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BLEND_KERNELS_HPP
+#define BLEND_KERNELS_HPP
+
+#include <cstdint>
+
+/** Row operations for composing animation frames.
+ *  The fastest instruction set supported by the CPU is picked at runtime. */
+namespace BlendKernels{
+	enum class Level{
+		SCALAR,
+		SSE2,
+		AVX2
+	};
+	
+	Level best();	//Fastest level supported by this CPU
+	Level level();	//Level currently in use
+	void setLevel( Level wanted );	//For benchmarking, limited to best()
+	const char* name( Level level );
+	
+	/** Copy 'in' to 'out', except pixels with the index 'transparent' */
+	void overlayIndexed( uint8_t* out, const uint8_t* in, int width, uint8_t transparent );
+	
+	/** Blend 'in' on top of 'out', both non-premultiplied ARGB32 */
+	void overlayArgb( uint32_t* out, const uint32_t* in, int width );
+}
+
+
+#endif
@@ -0,0 +1,38 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CANCEL_TOKEN_HPP
+#define CANCEL_TOKEN_HPP
+
+#include <atomic>
+#include <memory>
+
+/** Flag for aborting a read which is no longer needed.
+ *  Copies share the same flag, so one can be kept by the code which
+ *  might want to cancel while the reader checks another. */
+class CancelToken{
+	private:
+		std::shared_ptr<std::atomic<bool>> flag{ std::make_shared<std::atomic<bool>>( false ) };
+		
+	public:
+		void cancel(){ *flag = true; }
+		bool isCancelled() const{ return *flag; }
+};
+
+
+#endif
@@ -17,67 +17,119 @@
 
 #include "ImageReader.hpp"
 
-#include <QFile>
 #include <QFileInfo>
+#include "../FileSystem/MappedFile.hpp"
 #include "ReaderGif.hpp"
 #include "ReaderPng.hpp"
 #include "ReaderJpeg.hpp"
 #include "ReaderQt.hpp"
 
 ImageReader::ImageReader(){
-//	readers.push_back( std::make_unique<ReaderGif>() );
+	readers.push_back( std::make_unique<ReaderGif>() );
 	readers.push_back( std::make_unique<ReaderPng>() );
 	readers.push_back( std::make_unique<ReaderJpeg>() );
 	readers.push_back( std::make_unique<ReaderQt>() );
+	fallback = readers.back().get();
 	
-	for( auto& reader : readers )
+	for( auto& reader : readers ){
 		for( auto ext : reader->extensions() )
 			formats.insert( std::make_pair( ext.toLower(), reader.get() ) );
+		for( auto sig : reader->signatures() )
+			signatures.push_back( std::make_pair( reader.get(), sig ) );
+	}
 }
 
-AReader::Error ImageReader::read( imageCache &cache, QString filepath ) const{
-	QString ext = QFileInfo(filepath).suffix().toLower();
+/** The readers to try, in order. The file header takes precedence over the
+ *  extension, and auto-detection is tried if both fail. */
+std::vector<ImageReader::Candidate> ImageReader::candidates( const uint8_t* data, unsigned length, QString ext ) const{
+	std::vector<Candidate> list;
+	auto add = [&]( AReader* reader, QString format ){
+			for( auto& c : list )
+				if( c.reader == reader && c.format == format )
+					return;
+			list.push_back( { reader, format } );
+		};
+	
+	for( auto& sig : signatures )
+		if( sig.second.matches( data, length ) ){
+			add( sig.first, sig.second.format );
+			break;
+		}
 	
-	AReader* reader = nullptr;
 	auto it = formats.find( ext );
 	if( it != formats.end() )
-		reader = it->second;
-	else
-		return AReader::ERROR_TYPE_UNKNOWN;
+		add( it->second, ext );
+	
+	add( fallback, "" );
+	return list;
+}
+
+/** 'target' is the size the image will be displayed at, if valid the image
+ *  might be decoded at a reduced resolution. */
+AReader::Error ImageReader::read( imageCache &cache, QString filepath, const CancelToken& cancel, QSize target ) const{
+	QString ext = QFileInfo(filepath).suffix().toLower();
 	
-	QFile file( filepath );
 	cache.url = QUrl::fromLocalFile( filepath );
-	QByteArray data;
-	if( file.open( QIODevice::ReadOnly ) ){
-		data = file.readAll();
-		file.close();
-	}
-	else{
+	MappedFile data( filepath );
+	if( !data.isValid() ){
 		cache.set_status( imageCache::EMPTY );
 		return AReader::ERROR_NO_FILE;
 	}
 	
-	auto u_data = reinterpret_cast<const uint8_t*>( data.constData() );
-	AReader::Error err = reader->read( cache, u_data, data.size(), ext );
+	auto u_data = data.data();
+	auto ext_reader = formats.find( ext );
 	
-	if( err != AReader::ERROR_NONE ){
-		//TODO: we should check for the error more specifically
-		//Reading failed, lets try all the others and see if they can
-		cache.reset();
-		for( auto& r : readers ){
-			if( !r->can_read( u_data, data.size(), "" ) )
-				continue;
+	AReader::Error err = AReader::ERROR_TYPE_UNKNOWN;
+	for( auto& c : candidates( u_data, data.size(), ext ) ){
+		//Make the dimensions available while decoding
+		ImageInfo info;
+		QSize decode_target = target;
+		if( c.reader->probe( info, u_data, data.size(), c.format ) == AReader::ERROR_NONE ){
+			cache.set_orientation( info.orientation );
+			cache.set_size_hint( info.size );
+			
+			//The readers works on the image before it is rotated
+			decode_target = info.orientation.finalSize( target );
 			
-			if( r->read( cache, u_data, data.size(), "" ) == AReader::ERROR_NONE ){
+			//Something to show while decoding
+			auto thumbnail = c.reader->thumbnail( u_data, data.size(), c.format );
+			if( !thumbnail.isNull() )
+				cache.set_thumbnail( thumbnail );
+		}
+		
+		auto current = c.reader->read( cache, u_data, data.size(), c.format, cancel, decode_target );
+		if( current == AReader::ERROR_NONE ){
+			if( ext_reader == formats.end() || ext_reader->second != c.reader )
 				cache.error_msgs.append( QObject::tr( "Warning, wrong file extension" ) );
-				return AReader::ERROR_NONE;
-			}
-			cache.reset();
+			return current;
 		}
 		
-		cache.set_status( imageCache::INVALID );
+		cache.reset();
+		if( current == AReader::ERROR_CANCELLED )
+			return current;
+		
+		//Report the error of the most likely reader
+		if( err == AReader::ERROR_TYPE_UNKNOWN )
+			err = current;
 	}
 	
+	cache.set_status( imageCache::INVALID );
+	return err;
+}
+
+AReader::Error ImageReader::probe( ImageInfo& info, QString filepath ) const{
+	MappedFile data( filepath );
+	if( !data.isValid() )
+		return AReader::ERROR_NO_FILE;
+	
+	QString ext = QFileInfo(filepath).suffix().toLower();
+	AReader::Error err = AReader::ERROR_TYPE_UNKNOWN;
+	for( auto& c : candidates( data.data(), data.size(), ext ) ){
+		info = ImageInfo();
+		err = c.reader->probe( info, data.data(), data.size(), c.format );
+		if( err == AReader::ERROR_NONE )
+			break;
+	}
 	return err;
 }
 
@@ -28,11 +28,20 @@ class ImageReader{
 	protected:
 		std::vector<std::unique_ptr<AReader>> readers;
 		std::map<QString,AReader*> formats;
+		std::vector<std::pair<AReader*,Signature>> signatures;
+		AReader* fallback{ nullptr };	//Auto-detects, used as a last resort
+		
+		struct Candidate{
+			AReader* reader;
+			QString format;
+		};
+		std::vector<Candidate> candidates( const uint8_t* data, unsigned length, QString ext ) const;
 		
 	public:
 		ImageReader();
 		
-		AReader::Error read( imageCache &cache, QString filepath ) const;
+		AReader::Error read( imageCache &cache, QString filepath, const CancelToken& cancel, QSize target=QSize() ) const;
+		AReader::Error probe( ImageInfo& info, QString filepath ) const;
 		
 		QList<QString> supportedExtensions() const;
 };
@@ -0,0 +1,86 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KEYFRAME_SOURCE_HPP
+#define KEYFRAME_SOURCE_HPP
+
+#include "../viewer/FrameSource.hpp"
+
+#include <QtGlobal>
+#include <algorithm>
+#include <map>
+
+/** Frame source for formats which must be decoded from the start, because
+ *  each frame is drawn on top of the previous ones.
+ *  The decoder state is saved every 'interval' frames, so seeking and looping
+ *  only need to decode from the nearest keyframe.
+ *  @tparam State Everything needed to continue decoding, must be copyable
+ *                and default constructible */
+template<typename State>
+class KeyframeSource : public AFrameSource{
+	private:
+		std::map<unsigned, State> keyframes;
+		State current;
+		unsigned next{ 0 }; //The frame 'current' will produce next
+		unsigned interval;
+		
+	protected:
+		/** Decode frame 'index' and advance 'state' past it
+		 *  @return false on failure */
+		virtual bool decodeNext( unsigned index, State& state, QImage& output ) = 0;
+		
+		/** Set the state before the first frame, must be done before using frame() */
+		void setStart( State start ){ current = start; }
+		
+	public:
+		explicit KeyframeSource( unsigned interval ) : interval( std::max( interval, 1u ) ) { }
+		
+		QImage frame( unsigned index ) override{
+			//Continue from the current state if possible, otherwise from the nearest keyframe
+			auto keyframe = keyframes.upper_bound( index );
+			if( keyframe != keyframes.begin() ){
+				--keyframe;
+				if( index < next || keyframe->first > next ){
+					current = keyframe->second;
+					next = keyframe->first;
+				}
+			}
+			
+			QImage output;
+			for( ; next <= index; next++ ){
+				if( next % interval == 0 )
+					keyframes.emplace( next, current );
+				if( !decodeNext( next, current, output ) ){
+					//'current' is half-way through a frame, restart from the first keyframe
+					current = keyframes.begin()->second;
+					next = keyframes.begin()->first;
+					return {};
+				}
+			}
+			return output;
+		}
+		
+		/** Spread 'budget' bytes of keyframes evenly over the animation */
+		static unsigned intervalFor( unsigned frames, qint64 frame_bytes, qint64 budget ){
+			auto amount = std::max( budget / std::max( frame_bytes, qint64(1) ), qint64(1) );
+			return std::max( unsigned( (frames + amount - 1) / amount ), 1u );
+		}
+};
+
+
+#endif
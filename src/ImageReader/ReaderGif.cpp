@@ -19,18 +19,20 @@
 
 #include "ReaderGif.hpp"
 #include "AnimCombiner.hpp"
+#include "KeyframeSource.hpp"
 
 #include <QImage>
 #include <QPainter>
 #include <gif_lib.h>
 #include <cstring>
 #include <cmath>
+#include <memory>
 #include <vector>
 
 
 bool ReaderGif::can_read( const uint8_t* data, unsigned length, QString ) const{
-	return true;
-	//TODO: Find out if there is anything like this, or if we have to look for some MAGIC bytes
+	//"GIF87a" or "GIF89a"
+	return length >= 6 && std::memcmp( data, "GIF8", 4 ) == 0 && ( data[4] == '7' || data[4] == '9' ) && data[5] == 'a';
 }
 
 inline QRgb convertColorType( GifColorType color )
@@ -51,22 +53,19 @@ static QVector<QRgb> convertColorMap( ColorMapObject* map ){
 	return table;
 }
 
-static QImage convertImage( GifImageDesc image, GifByteType* raster, ColorMapObject* parent ){
-	QImage img( image.Width, image.Height, QImage::Format_Indexed8 );
-	img.setColorTable( convertColorMap( image.ColorMap ? image.ColorMap : parent ) );
-	
-	for( int iy=0; iy<image.Height; iy++ )
-		std::memcpy( img.scanLine( iy ), raster+image.Width*iy, image.Width );
-	
-	return img;
-}
-
-
 struct Reader{
+	const uint8_t* start;
 	const uint8_t* data;
+	unsigned length;
 	unsigned remaining;
 	
-	Reader( const uint8_t* data, unsigned remaining ) : data(data), remaining(remaining) { }
+	Reader( const uint8_t* data, unsigned length ) : start(data), data(data), length(length), remaining(length) { }
+	
+	unsigned position() const{ return data - start; }
+	void seek( unsigned pos ){
+		data = start + pos;
+		remaining = length - pos;
+	}
 };
 
 static int ReadFromReader( GifFileType* gif, GifByteType* out, int amount ){
@@ -79,6 +78,112 @@ static int ReadFromReader( GifFileType* gif, GifByteType* out, int amount ){
 }
 
 
+/** Skips the remaining sub-blocks of an extension */
+static bool skipExtension( GifFileType* gif, GifByteType* block ){
+	while( block )
+		if( DGifGetExtensionNext( gif, &block ) != GIF_OK )
+			return false;
+	return true;
+}
+
+/** Skips the compressed image data without decompressing it */
+static bool skipImageData( GifFileType* gif ){
+	int code_size;
+	GifByteType* block;
+	if( DGifGetCode( gif, &code_size, &block ) != GIF_OK )
+		return false;
+	while( block )
+		if( DGifGetCodeNext( gif, &block ) != GIF_OK )
+			return false;
+	return true;
+}
+
+/** Reads the loop count from a NETSCAPE2.0 application extension.
+ *  @return true if it was such an extension */
+static bool readLoopCount( GifFileType* gif, GifByteType*& block, int& loops ){
+	if( !block || block[0] != 11 || std::memcmp( block+1, "NETSCAPE2.0", 11 ) != 0 )
+		return false;
+	
+	if( DGifGetExtensionNext( gif, &block ) != GIF_OK )
+		return false;
+	if( block && block[0] >= 3 && block[1] == 1 ){
+		int count = block[2] | (block[3] << 8);
+		loops = count == 0 ? -1 : count; //0 means forever
+	}
+	return true;
+}
+
+static int gifDelay( const GraphicsControlBlock& gcb ){
+	auto delay = gcb.DelayTime * 10;
+	return (delay == 0) ? 100 : delay; //TODO: replace with constant
+}
+
+static const GraphicsControlBlock no_gcb{ DISPOSAL_UNSPECIFIED, false, 0, NO_TRANSPARENT_COLOR };
+
+/** Walks through the records without decompressing the images
+ *  @param delays If not null, set to the delay of each frame */
+static AReader::Error scanRecords( const uint8_t* data, unsigned length, ImageInfo& info, int& loops, std::vector<int>* delays=nullptr ){
+	Reader reader( data, length );
+	int error;
+	auto gif = DGifOpen( &reader, &ReadFromReader, &error );
+	if( !gif )
+		return AReader::ERROR_INITIALIZATION;
+	
+	info.size = QSize( gif->SWidth, gif->SHeight );
+	info.bit_depth = 8;
+	loops = 0; //Play once without the NETSCAPE2.0 extension
+	
+	auto result = AReader::ERROR_NONE;
+	auto gcb = no_gcb;
+	GifRecordType type = UNDEFINED_RECORD_TYPE;
+	while( type != TERMINATE_RECORD_TYPE && result == AReader::ERROR_NONE ){
+		if( DGifGetRecordType( gif, &type ) != GIF_OK ){
+			result = AReader::ERROR_FILE_BROKEN;
+			break;
+		}
+		
+		switch( type ){
+			case IMAGE_DESC_RECORD_TYPE:
+					if( DGifGetImageDesc( gif ) != GIF_OK || !skipImageData( gif ) )
+						result = AReader::ERROR_FILE_BROKEN;
+					info.frames++;
+					if( delays )
+						delays->push_back( gifDelay( gcb ) );
+					gcb = no_gcb;
+				break;
+			
+			case EXTENSION_RECORD_TYPE:{
+					int code;
+					GifByteType* block;
+					if( DGifGetExtension( gif, &code, &block ) != GIF_OK )
+						result = AReader::ERROR_FILE_BROKEN;
+					else{
+						if( code == APPLICATION_EXT_FUNC_CODE )
+							readLoopCount( gif, block, loops );
+						if( code == GRAPHICS_EXT_FUNC_CODE && block )
+							DGifExtensionToGCB( block[0], block+1, &gcb );
+						if( !skipExtension( gif, block ) )
+							result = AReader::ERROR_FILE_BROKEN;
+					}
+				} break;
+			
+			default: break;
+		}
+	}
+	info.animated = info.frames > 1;
+	
+	DGifCloseFile( gif, &error );
+	return result;
+}
+
+AReader::Error ReaderGif::probe( ImageInfo& info, const uint8_t* data, unsigned length, QString format ) const{
+	if( !can_read( data, length, format ) )
+		return ERROR_TYPE_UNKNOWN;
+	
+	int loops;
+	return scanRecords( data, length, info, loops );
+}
+
 static DisposeMode gifDispose( GraphicsControlBlock* gcb ){
 	if( !gcb )
 		return DisposeMode::NONE;
@@ -96,55 +201,206 @@ static DisposeMode gifDispose( GraphicsControlBlock* gcb ){
 }
 
 
-AReader::Error ReaderGif::read( imageCache &cache, const uint8_t* data, unsigned length, QString format ) const{
+/** Decodes the image data of the current image descriptor */
+static bool readFrame( GifFileType* gif, QImage& img, const CancelToken& cancel ){
+	auto& desc = gif->Image;
+	img = QImage( desc.Width, desc.Height, QImage::Format_Indexed8 );
+	img.setColorTable( convertColorMap( desc.ColorMap ? desc.ColorMap : gif->SColorMap ) );
+	
+	auto readRow = [&]( int iy ){
+			if( cancel.isCancelled() )
+				return false;
+			return DGifGetLine( gif, img.scanLine( iy ), desc.Width ) == GIF_OK;
+		};
+	
+	if( desc.Interlace ){
+		//Rows are stored in four passes
+		const int offsets[] = { 0, 4, 2, 1 };
+		const int steps[]   = { 8, 8, 4, 2 };
+		for( int pass=0; pass<4; pass++ )
+			for( int iy=offsets[pass]; iy<desc.Height; iy+=steps[pass] )
+				if( !readRow( iy ) )
+					return false;
+	}
+	else
+		for( int iy=0; iy<desc.Height; iy++ )
+			if( !readRow( iy ) )
+				return false;
+	
+	return true;
+}
+
+/** Frames are drawn on a canvas of the logical screen size */
+static AnimCombiner createCombiner( GifFileType* gif ){
+	auto global_palette = convertColorMap( gif->SColorMap );
+	auto background = gif->SColorMap
+		?	IndexColor( gif->SBackGroundColor, global_palette )
+		:	IndexColor( qRgba( 0,0,0,0 ) );
+	QImage canvas;
+	if( gif->SColorMap ){
+		canvas = QImage( gif->SWidth, gif->SHeight, QImage::Format_Indexed8 );
+		canvas.setColorTable( global_palette );
+		canvas.fill( background.getIndexed() );
+	}
+	else{
+		canvas = QImage( gif->SWidth, gif->SHeight, QImage::Format_ARGB32 );
+		canvas.fill( background.getRgb() );
+	}
+	AnimCombiner combiner( canvas );
+	combiner.setBackgroundColor( background );
+	return combiner;
+}
+
+/** Reads records until the next image has been composed
+ *  @param output Set to the composed frame, or a null image if there are no more images
+ *  @param delay Set to the delay of 'output' */
+static AReader::Error readNextFrame( GifFileType* gif, AnimCombiner& combiner, QImage& output, int& delay, const CancelToken& cancel ){
+	output = {};
+	auto gcb = no_gcb; //The control block only applies to the next image
+	GifRecordType type = UNDEFINED_RECORD_TYPE;
+	while( type != TERMINATE_RECORD_TYPE ){
+		if( DGifGetRecordType( gif, &type ) != GIF_OK )
+			return AReader::ERROR_FILE_BROKEN;
+		
+		switch( type ){
+			case IMAGE_DESC_RECORD_TYPE:{
+					QImage img;
+					if( DGifGetImageDesc( gif ) != GIF_OK || !readFrame( gif, img, cancel ) )
+						return cancel.isCancelled() ? AReader::ERROR_CANCELLED : AReader::ERROR_FILE_BROKEN;
+					
+					delay = gifDelay( gcb );
+					auto transparent = IndexColor( gcb.TransparentColor, img.colorTable() );
+					auto& desc = gif->Image;
+					output = combiner.combine( img, desc.Left, desc.Top, BlendMode::OVERLAY, gifDispose( &gcb ), transparent );
+					return AReader::ERROR_NONE;
+				}
+			
+			case EXTENSION_RECORD_TYPE:{
+					int code;
+					GifByteType* block;
+					if( DGifGetExtension( gif, &code, &block ) != GIF_OK )
+						return AReader::ERROR_FILE_BROKEN;
+					if( code == GRAPHICS_EXT_FUNC_CODE && block )
+						DGifExtensionToGCB( block[0], block+1, &gcb );
+					if( !skipExtension( gif, block ) )
+						return AReader::ERROR_FILE_BROKEN;
+				} break;
+			
+			default: break;
+		}
+	}
+	return AReader::ERROR_NONE;
+}
+
+
+struct GifState{
+	unsigned position{ 0 }; //Start of the records for the next frame
+	AnimCombiner combiner{ QImage() };
+};
+
+/** Decodes frames on demand for animations too large to keep in memory */
+class GifFrameSource : public KeyframeSource<GifState>{
+	private:
+		QByteArray file; //Own copy, as the mapped file is closed after loading
+		Reader reader;
+		GifFileType* gif{ nullptr };
+		CancelToken cancel; //Never used, but needed for readFrame()
+		
+	protected:
+		bool decodeNext( unsigned, GifState& state, QImage& output ) override{
+			//giflib does not buffer between records, so we can just move the input
+			reader.seek( state.position );
+			int delay;
+			auto result = readNextFrame( gif, state.combiner, output, delay, cancel );
+			
+			//giflib keeps a copy of every image descriptor, which would keep growing while looping
+			GifFreeSavedImages( gif );
+			gif->ImageCount = 0;
+			
+			if( result != AReader::ERROR_NONE || output.isNull() )
+				return false;
+			state.position = reader.position();
+			return true;
+		}
+		
+	public:
+		GifFrameSource( const uint8_t* data, unsigned length, unsigned interval )
+			:	KeyframeSource( interval )
+			,	file( (const char*)data, length )
+			,	reader( (const uint8_t*)file.constData(), file.size() )
+			{
+			int error;
+			gif = DGifOpen( &reader, &ReadFromReader, &error );
+			if( gif ){
+				GifState start;
+				start.position = reader.position();
+				start.combiner = createCombiner( gif );
+				setStart( start );
+			}
+		}
+		GifFrameSource( const GifFrameSource& ) = delete;
+		~GifFrameSource(){
+			int error;
+			if( gif )
+				DGifCloseFile( gif, &error );
+		}
+		
+		bool isValid() const{ return gif; }
+};
+
+AReader::Error ReaderGif::read( imageCache &cache, const uint8_t* data, unsigned length, QString format, const CancelToken& cancel, QSize ) const{
 	if( !can_read( data, length, format ) )
 		return ERROR_TYPE_UNKNOWN;
 	
+	//Find the amount of frames first, so the viewer knows the length of the animation
+	ImageInfo info;
+	int loops;
+	std::vector<int> delays;
+	auto scan_result = scanRecords( data, length, info, loops, &delays );
+	if( scan_result != ERROR_NONE )
+		cache.error_msgs.append( QObject::tr( "GIF file is broken or truncated" ) );
+	cache.set_info( info.frames, info.frames > 1, loops );
+	
+	//Decode large animations on demand, instead of keeping every frame
+	auto limit = imageCache::get_memory_limit();
+	qint64 frame_bytes = qint64( info.size.width() ) * info.size.height() * 4;
+	if( scan_result == ERROR_NONE && info.frames > 1 && frame_bytes * info.frames > limit ){
+		auto interval = GifFrameSource::intervalFor( info.frames, frame_bytes, limit / 2 );
+		auto source = std::make_unique<GifFrameSource>( data, length, interval );
+		if( source->isValid() ){
+			cache.set_frame_source( std::move( source ), info.size, std::move( delays ) );
+			cache.set_fully_loaded();
+			return ERROR_NONE;
+		}
+	}
+	
 	//Set up reader
 	Reader reader( data, length );
 	int error;
 	auto gif = DGifOpen( &reader, &ReadFromReader, &error );
 	if( !gif )
-		return ERROR_INITIALIZATION; //??
-	
-	//Read entire image
-	if( DGifSlurp( gif ) != GIF_OK )
-		return ERROR_FILE_BROKEN;
+		return ERROR_INITIALIZATION;
+	auto combiner = createCombiner( gif );
 	
-	cache.set_info( gif->ImageCount, true, -1 );
-	qDebug( "Size: %dx%d", gif->SWidth, gif->SHeight );
+	//Decode and show each frame as soon as it is read
+	auto result = ERROR_NONE;
+	while( true ){
+		QImage frame;
+		int delay;
+		result = readNextFrame( gif, combiner, frame, delay, cancel );
+		if( result != ERROR_NONE || frame.isNull() )
+			break;
+		cache.add_frame( frame, delay, combiner.changedArea() );
+	}
+	DGifCloseFile( gif, &error );
 	
-	//TODO:
-	AnimCombiner combiner( {} );
+	if( result == ERROR_CANCELLED )
+		return result;
 	
-	//Set background color
-	auto global_palette = convertColorMap( gif->SColorMap );
-	//TODO: default color if no global map?
-	combiner.setBackgroundColor( { gif->SBackGroundColor, global_palette } );
+	//Show what we got of truncated files
+	if( result != ERROR_NONE && cache.loaded() == 0 )
+		return result;
 	
-	for( int i=0; i<gif->ImageCount; i++ ){
-		//qDebug( "Local color map: %p", gif->SavedImages[i].ImageDesc.ColorMap );
-		auto saved = gif->SavedImages[i];
-		auto img = convertImage( saved.ImageDesc, saved.RasterBits, gif->SColorMap );
-		
-		GraphicsControlBlock gcb;
-		if( DGifSavedExtensionToGCB( gif, i, &gcb ) != GIF_OK )
-			qDebug( "Did not contain stuff" );
-		auto dispose = gifDispose( &gcb ); //TODO: If none
-		
-		auto delay = gcb.DelayTime * 10;
-		delay = (delay == 0) ? 100 : delay; //TODO: replace with constant
-		//TODO: Be 0 if no gcb
-		
-		//TODO: Clean up palette access
-		auto palette = convertColorMap( saved.ImageDesc.ColorMap ? saved.ImageDesc.ColorMap : gif->SColorMap );
-		auto transparent = IndexColor( gcb.TransparentColor, palette );
-		//TODO: check for -1
-		
-		cache.add_frame( combiner.combine( img, saved.ImageDesc.Left, saved.ImageDesc.Top, BlendMode::OVERLAY, dispose, transparent ), delay );
-	}
-	
-	//Clean up
-	return (DGifCloseFile( gif, &error ) != GIF_OK) ? ERROR_UNKNOWN : ERROR_NONE;
+	cache.set_fully_loaded();
+	return ERROR_NONE;
 }
-
@@ -24,8 +24,10 @@
 class ReaderGif: public AReader{
 	public:
 		QList<QString> extensions() const{ return QStringList() << "gif"; }
-		virtual Error read( imageCache &cache, const uint8_t* data, unsigned length, QString format ) const;
+		QList<Signature> signatures() const{ return { { 0, "GIF87a", "gif" }, { 0, "GIF89a", "gif" } }; }
+		virtual Error read( imageCache &cache, const uint8_t* data, unsigned length, QString format, const CancelToken& cancel, QSize target ) const;
 		virtual bool can_read( const uint8_t* data, unsigned length, QString format ) const;
+		virtual Error probe( ImageInfo& info, const uint8_t* data, unsigned length, QString format ) const;
 };
 
 
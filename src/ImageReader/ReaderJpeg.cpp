@@ -23,8 +23,14 @@
 
 #include <QImage>
 #include <QFile>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QtConcurrent>
 #include <memory>
 #include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
 
 struct MetaTest{
 	unsigned marker_id;
@@ -54,8 +60,8 @@ static void output_message( j_common_ptr cinfo ){
 	char buf[JMSG_LENGTH_MAX];
 	(*cinfo->err->format_message)( cinfo, buf );
 	
-	auto cache = static_cast<imageCache*>( cinfo->client_data );
-	cache->error_msgs << QString::fromLatin1( buf );
+	auto errors = static_cast<QStringList*>( cinfo->client_data );
+	*errors << QString::fromLatin1( buf );
 }
 static void error_exit( j_common_ptr cinfo ){
 	(*cinfo->err->output_message)( cinfo );
@@ -93,17 +99,449 @@ class JpegDecompress{
 		
 		unsigned bytesPerLine() const
 			{ return cinfo.output_width * cinfo.output_components; }
+		
+		/** Let libjpeg skip detail which would not be visible at 'target'.
+		 *  Must be called after readHeader(). @return true if scaled */
+		bool scaleTo( QSize target ){
+			if( !target.isValid() || cinfo.image_width == 0 || cinfo.image_height == 0 )
+				return false;
+			
+			//Smallest scale in eights which still covers 'target' when fitted
+			double wanted = std::min(
+					target.width()  / (double)cinfo.image_width
+				,	target.height() / (double)cinfo.image_height
+				);
+			unsigned num = std::max( 1, (int)std::ceil( wanted * 8 ) );
+			if( num >= 8 )
+				return false;
+			
+			cinfo.scale_num = num;
+			cinfo.scale_denom = 8;
+			return true;
+		}
+		
+		/** Make libjpeg output pixels in the memory layout of a QImage format.
+		 *  Must be called after readHeader(). @return The format, or Format_Invalid if not possible */
+		QImage::Format directFormat(){
+#if QT_VERSION >= 0x050500
+			if( cinfo.out_color_space == JCS_GRAYSCALE )
+				return QImage::Format_Grayscale8;
+#endif
+#ifdef JCS_EXTENSIONS
+			//Only libjpeg-turbo supports this, and the header might not match the library
+			if( cinfo.out_color_space == JCS_RGB ){
+				cinfo.out_color_space = ( Q_BYTE_ORDER == Q_LITTLE_ENDIAN ) ? JCS_EXT_BGRX : JCS_EXT_XRGB;
+				jpeg_calc_output_dimensions( &cinfo );
+				if( cinfo.out_color_components == 4 )
+					return QImage::Format_RGB32;
+				cinfo.out_color_space = JCS_RGB;
+			}
+#endif
+			return QImage::Format_Invalid;
+		}
 };
 
 
-AReader::Error ReaderJpeg::read( imageCache &cache, const uint8_t* data, unsigned length, QString format ) const{
+AReader::Error ReaderJpeg::probe( ImageInfo& info, const uint8_t* data, unsigned length, QString format ) const{
+	if( !can_read( data, length, format ) )
+		return ERROR_TYPE_UNKNOWN;
+	
+	try{
+		QStringList errors;
+		JpegDecompress jpeg( data, length );
+		jpeg.cinfo.client_data = &errors;
+		jpeg.saveMarker( ICC_META_TEST );
+		jpeg.saveMarker( EXIF_META_TEST );
+		jpeg.readHeader();
+		
+		info.size = QSize( jpeg.cinfo.image_width, jpeg.cinfo.image_height );
+		info.bit_depth = jpeg.cinfo.data_precision;
+		info.frames = 1;
+		
+		for( auto marker = jpeg.cinfo.marker_list; marker; marker = marker->next ){
+			if( ICC_META_TEST.validate( marker ) )
+				info.has_profile = true;
+			if( EXIF_META_TEST.validate( marker ) ){
+				meta exif(
+						marker->data        + EXIF_META_TEST.length
+					,	marker->data_length - EXIF_META_TEST.length
+					);
+				info.orientation = exif.get_orientation();
+			}
+		}
+		
+		return ERROR_NONE;
+	}
+	catch( int err_code ){
+		switch( err_code ){
+			case JERR_NO_SOI: return ERROR_TYPE_UNKNOWN;
+			default: return ERROR_FILE_BROKEN;
+		};
+	}
+}
+
+QImage ReaderJpeg::thumbnail( const uint8_t* data, unsigned length, QString format ) const{
+	if( !can_read( data, length, format ) )
+		return {};
+	
+	try{
+		QStringList errors;
+		JpegDecompress jpeg( data, length );
+		jpeg.cinfo.client_data = &errors;
+		jpeg.saveMarker( EXIF_META_TEST );
+		jpeg.readHeader();
+		
+		for( auto marker = jpeg.cinfo.marker_list; marker; marker = marker->next )
+			if( EXIF_META_TEST.validate( marker ) )
+				return meta(
+						marker->data        + EXIF_META_TEST.length
+					,	marker->data_length - EXIF_META_TEST.length
+					).get_thumbnail();
+	}
+	catch( int ){ }
+	
+	return {};
+}
+
+/** Decodes an output pass into 'rows'. If 'convert', each row is converted to
+ *  RGB32, otherwise libjpeg writes several rows at a time directly into them.
+ *  @param report Update the progress of the partial frame */
+static AReader::Error readPass( JpegDecompress& jpeg, imageCache& cache, std::vector<JSAMPROW>& rows, bool convert, bool report, const CancelToken& cancel ){
+	auto buffer = std::make_unique<JSAMPLE[]>( convert ? jpeg.bytesPerLine() : 0 );
+	JSAMPLE* arr[1] = { buffer.get() };
+	bool is_gray = jpeg.cinfo.out_color_components == 1;
+	
+	const JDIMENSION batch = 16;
+	while( jpeg.cinfo.output_scanline < jpeg.cinfo.output_height ){
+		if( cancel.isCancelled() )
+			return AReader::ERROR_CANCELLED;
+		
+		auto pos = jpeg.cinfo.output_scanline;
+		if( convert ){
+			auto out = (QRgb*)rows[ pos ];
+			jpeg_read_scanlines( &jpeg.cinfo, arr, 1 );
+			
+			if( is_gray )
+				for( unsigned ix=0; ix<jpeg.cinfo.output_width; ix++ )
+					out[ix] = qRgb( buffer[ix], buffer[ix], buffer[ix] );
+			else
+				for( unsigned ix=0; ix<jpeg.cinfo.output_width; ix++ )
+					out[ix] = qRgb( buffer[ix*3+0], buffer[ix*3+1], buffer[ix*3+2] );
+		}
+		else
+			jpeg_read_scanlines( &jpeg.cinfo, rows.data() + pos, std::min( batch, jpeg.cinfo.output_height - pos ) );
+		
+		if( report )
+			cache.set_partial_progress( jpeg.cinfo.output_scanline );
+	}
+	
+	return AReader::ERROR_NONE;
+}
+
+/** Shows the image after each scan of a progressive JPEG. The decoder must be
+ *  in buffered-image mode. Scans completing shortly after the last output are
+ *  not shown, so the extra passes does not delay the final one noticeably. */
+static AReader::Error readProgressive( JpegDecompress& jpeg, imageCache& cache, std::vector<JSAMPROW>& rows, bool convert, const CancelToken& cancel ){
+	QElapsedTimer timer;
+	qint64 wait = 0; //Show the first scan immediately
+	bool first = true;
+	
+	while( true ){
+		timer.start();
+		int status;
+		do{
+			if( cancel.isCancelled() )
+				return AReader::ERROR_CANCELLED;
+			status = jpeg_consume_input( &jpeg.cinfo );
+		} while( status != JPEG_REACHED_EOI && status != JPEG_SUSPENDED
+			&&	!( status == JPEG_SCAN_COMPLETED && timer.elapsed() >= wait )
+			);
+		bool last = jpeg_input_complete( &jpeg.cinfo ) || status == JPEG_SUSPENDED;
+		
+		//Output what we have so far
+		QElapsedTimer output_time;
+		output_time.start();
+		jpeg_start_output( &jpeg.cinfo, jpeg.cinfo.input_scan_number );
+		auto err = readPass( jpeg, cache, rows, convert, first, cancel );
+		if( err != AReader::ERROR_NONE )
+			return err;
+		jpeg_finish_output( &jpeg.cinfo );
+		
+		if( last )
+			return AReader::ERROR_NONE;
+		
+		cache.finish_partial_pass();
+		first = false;
+		wait = std::max( qint64(100), 2 * output_time.elapsed() );
+	}
+}
+
+/* Parallel decoding
+ * Restart markers reset the entropy decoder, so the data between them can be
+ * decoded independently. Each segment gets its own JPEG, made of the original
+ * header with a different height and the restart intervals of its rows. The
+ * segments overlap with their neighbours, so upsampling at the borders sees
+ * the same rows as a sequential decode would.
+ */
+
+static unsigned readUint16( const uint8_t* data ){ return (data[0] << 8) | data[1]; }
+
+/** Location of the restart intervals in a baseline JPEG */
+struct JpegLayout{
+	unsigned height_pos{ 0 };	//Offset of the 16-bit image height in the SOF marker
+	unsigned header_end{ 0 };	//Start of the entropy coded data
+	unsigned width{ 0 };
+	unsigned height{ 0 };
+	unsigned mcu_width{ 8 };
+	unsigned mcu_height{ 8 };
+	unsigned restart_interval{ 0 };
+	std::vector<std::pair<unsigned,unsigned>> intervals; //Begin and end of each restart interval
+	
+	unsigned unit_rows{ 0 };	//MCU rows in the smallest part which can be decoded alone
+	unsigned unit_intervals{ 0 };	//Restart intervals in such a part
+	
+	bool parseHeader( const uint8_t* data, unsigned length );
+	bool parseIntervals( const uint8_t* data, unsigned length );
+	bool parse( const uint8_t* data, unsigned length )
+		{ return parseHeader( data, length ) && parseIntervals( data, length ); }
+	
+	unsigned mcusPerRow() const{ return ( width + mcu_width - 1 ) / mcu_width; }
+	unsigned mcuRows() const{ return ( height + mcu_height - 1 ) / mcu_height; }
+	unsigned units() const{ return ( mcuRows() + unit_rows - 1 ) / unit_rows; }
+	unsigned unitRow( unsigned unit ) const{ return std::min( unit * unit_rows * mcu_height, height ); }
+	unsigned unitInterval( unsigned unit ) const
+		{ return std::min( unit * unit_intervals, unsigned(intervals.size()) ); }
+	
+	std::vector<uint8_t> createSegment( const uint8_t* data, unsigned first_unit, unsigned last_unit ) const;
+};
+
+bool JpegLayout::parseHeader( const uint8_t* data, unsigned length ){
+	unsigned components = 0;
+	unsigned pos = 2; //Skip SOI
+	while( pos + 4 <= length ){
+		if( data[pos] != 0xFF )
+			return false;
+		uint8_t marker = data[pos+1];
+		if( marker == 0xFF ){ //Fill byte
+			pos++;
+			continue;
+		}
+		pos += 2;
+		
+		unsigned size = readUint16( data + pos );
+		if( size < 2 || pos + size > length )
+			return false;
+		
+		switch( marker ){
+			case 0xC0: //Baseline
+			case 0xC1: //Extended sequential, Huffman
+					if( size < 8 || data[pos+2] != 8 )
+						return false;
+					height_pos = pos + 3;
+					height = readUint16( data + pos + 3 );
+					width  = readUint16( data + pos + 5 );
+					components = data[pos+7];
+					if( components == 0 || size < 8 + 3*components )
+						return false;
+					
+					if( components > 1 ){
+						unsigned h_max = 1, v_max = 1;
+						for( unsigned i=0; i<components; i++ ){
+							auto sampling = data[pos + 9 + 3*i];
+							h_max = std::max( h_max, unsigned(sampling >> 4) );
+							v_max = std::max( v_max, unsigned(sampling & 0xF) );
+						}
+						mcu_width  = 8 * h_max;
+						mcu_height = 8 * v_max;
+					}
+				break;
+			
+			case 0xC2: case 0xC3: case 0xC5: case 0xC6: case 0xC7: //Progressive, lossless, hierarchical
+			case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF: //Arithmetic coding
+				return false;
+			
+			case 0xDD: //DRI
+					if( size < 4 )
+						return false;
+					restart_interval = readUint16( data + pos + 2 );
+				break;
+			
+			case 0xDA: //SOS, only a single scan containing all components is supported
+					if( components == 0 || size < 3 || data[pos+2] != components )
+						return false;
+					header_end = pos + size;
+					return width > 0 && height > 0 && restart_interval > 0;
+			
+			case 0xD9: return false; //EOI
+			default: break;
+		}
+		pos += size;
+	}
+	return false;
+}
+
+bool JpegLayout::parseIntervals( const uint8_t* data, unsigned length ){
+	//Find the RST markers, ignoring stuffed zero bytes and fill bytes
+	unsigned begin = header_end;
+	unsigned pos = header_end;
+	while( true ){
+		auto found = static_cast<const uint8_t*>( std::memchr( data + pos, 0xFF, length - pos ) );
+		if( !found || found + 1 >= data + length )
+			return false; //Truncated file
+		pos = found - data;
+		
+		auto marker = data[pos+1];
+		if( marker == 0x00 || marker == 0xFF )
+			pos++;
+		else if( marker >= 0xD0 && marker <= 0xD7 ){
+			intervals.emplace_back( begin, pos );
+			pos += 2;
+			begin = pos;
+		}
+		else{
+			intervals.emplace_back( begin, pos );
+			break;
+		}
+	}
+	
+	unsigned mcus = mcusPerRow() * mcuRows();
+	if( intervals.size() != ( mcus + restart_interval - 1 ) / restart_interval )
+		return false;
+	
+	//The intervals must line up with the MCU rows
+	if( mcusPerRow() % restart_interval == 0 ){
+		unit_rows = 1;
+		unit_intervals = mcusPerRow() / restart_interval;
+	}
+	else if( restart_interval % mcusPerRow() == 0 ){
+		unit_rows = restart_interval / mcusPerRow();
+		unit_intervals = 1;
+	}
+	else
+		return false;
+	
+	return true;
+}
+
+/** Create a JPEG containing the units from 'first_unit' to 'last_unit' */
+std::vector<uint8_t> JpegLayout::createSegment( const uint8_t* data, unsigned first_unit, unsigned last_unit ) const{
+	auto first = unitInterval( first_unit );
+	auto last  = unitInterval( last_unit );
+	auto rows = unitRow( last_unit ) - unitRow( first_unit );
+	
+	unsigned size = header_end + 2;
+	for( unsigned i=first; i<last; i++ )
+		size += intervals[i].second - intervals[i].first + 2;
+	
+	std::vector<uint8_t> out;
+	out.reserve( size );
+	out.insert( out.end(), data, data + header_end );
+	out[height_pos  ] = rows >> 8;
+	out[height_pos+1] = rows & 0xFF;
+	
+	for( unsigned i=first; i<last; i++ ){
+		//Restart markers must be numbered from the start of the scan
+		if( i != first ){
+			out.push_back( 0xFF );
+			out.push_back( 0xD0 + (i - first - 1) % 8 );
+		}
+		out.insert( out.end(), data + intervals[i].first, data + intervals[i].second );
+	}
+	out.push_back( 0xFF );
+	out.push_back( 0xD9 );
+	return out;
+}
+
+/** Decodes the restart intervals on several threads. Corrupt data will cause
+ *  it to fail, so the sequential decoder can handle it and report the errors */
+static AReader::Error readParallel( const uint8_t* data, const JpegLayout& layout, QImage::Format format, const CancelToken& cancel, QImage& out ){
+	//Each segment needs enough rows to make up for the overlap
+	auto units = layout.units();
+	unsigned count = std::min( { unsigned(QThread::idealThreadCount()), units / 4, layout.height / 256 } );
+	if( count < 2 )
+		return AReader::ERROR_UNSUPPORTED;
+	
+	QImage frame( layout.width, layout.height, format );
+	if( frame.isNull() )
+		return AReader::ERROR_UNSUPPORTED;
+	std::vector<JSAMPROW> rows;
+	rows.reserve( frame.height() );
+	for( int iy=0; iy<frame.height(); iy++ )
+		rows.push_back( frame.scanLine( iy ) );
+	
+	struct Segment{
+		unsigned first_unit;
+		unsigned last_unit;
+		AReader::Error err{ AReader::ERROR_NONE };
+	};
+	std::vector<Segment> segments;
+	for( unsigned i=0; i<count; i++ )
+		segments.push_back( { units * i / count, units * (i+1) / count } );
+	
+	QtConcurrent::blockingMap( segments, [&]( Segment& segment ){
+			//Decode one extra unit on each side, which is discarded
+			auto first = segment.first_unit > 0 ? segment.first_unit - 1 : 0;
+			auto last  = std::min( segment.last_unit + 1, units );
+			auto offset = layout.unitRow( first );
+			auto own_begin = layout.unitRow( segment.first_unit );
+			auto own_end   = layout.unitRow( segment.last_unit );
+			
+			auto buffer = layout.createSegment( data, first, last );
+			std::vector<uint8_t> discard( frame.bytesPerLine() );
+			try{
+				QStringList errors;
+				JpegDecompress jpeg( buffer.data(), buffer.size() );
+				jpeg.cinfo.client_data = &errors;
+				jpeg.readHeader();
+				if( jpeg.directFormat() != format )
+					throw int( JERR_CONVERSION_NOTIMPL );
+				jpeg_start_decompress( &jpeg.cinfo );
+				if( jpeg.cinfo.output_width != layout.width || jpeg.cinfo.output_height != layout.unitRow( last ) - offset )
+					throw int( JERR_BAD_DIMENSION );
+				
+				std::vector<JSAMPROW> segment_rows;
+				for( unsigned iy=offset; iy<offset+jpeg.cinfo.output_height; iy++ )
+					segment_rows.push_back( ( iy >= own_begin && iy < own_end ) ? rows[iy] : discard.data() );
+				
+				const JDIMENSION batch = 16;
+				while( jpeg.cinfo.output_scanline < jpeg.cinfo.output_height ){
+					if( cancel.isCancelled() ){
+						segment.err = AReader::ERROR_CANCELLED;
+						return;
+					}
+					auto pos = jpeg.cinfo.output_scanline;
+					jpeg_read_scanlines( &jpeg.cinfo, segment_rows.data() + pos, std::min( batch, jpeg.cinfo.output_height - pos ) );
+				}
+				jpeg_finish_decompress( &jpeg.cinfo );
+				
+				//Warnings about corrupt data
+				if( !errors.isEmpty() )
+					segment.err = AReader::ERROR_FILE_BROKEN;
+			}
+			catch( int ){
+				segment.err = AReader::ERROR_FILE_BROKEN;
+			}
+		} );
+	
+	for( auto& segment : segments )
+		if( segment.err == AReader::ERROR_CANCELLED )
+			return segment.err;
+	for( auto& segment : segments )
+		if( segment.err != AReader::ERROR_NONE )
+			return segment.err;
+	
+	out = frame;
+	return AReader::ERROR_NONE;
+}
+
+AReader::Error ReaderJpeg::read( imageCache &cache, const uint8_t* data, unsigned length, QString format, const CancelToken& cancel, QSize target ) const{
 	if( !can_read( data, length, format ) )
 		return ERROR_TYPE_UNKNOWN;
 	
 	try{
 		cache.set_info( 1 );
 		JpegDecompress jpeg( data, length );
-		jpeg.cinfo.client_data = &cache;
+		jpeg.cinfo.client_data = &cache.error_msgs;
 		
 		//Save application data, we are interested in ICC profiles and EXIF metadata
 		jpeg.saveMarker( ICC_META_TEST );
@@ -116,29 +554,50 @@ AReader::Error ReaderJpeg::read( imageCache &cache, const uint8_t* data, unsigne
 		
 		//Read header and set-up image
 		jpeg.readHeader();
-		jpeg_start_decompress( &jpeg.cinfo );
+		if( jpeg.scaleTo( target ) )
+			cache.set_scaled( QSize( jpeg.cinfo.image_width, jpeg.cinfo.image_height ) );
+		auto direct = direct_output ? jpeg.directFormat() : QImage::Format_Invalid;
 		
-		bool is_gray;
-		switch( jpeg.cinfo.out_color_components ){
-			case 1: is_gray = true; break;
-			case 3: is_gray = false; break;
-			default: return ERROR_UNSUPPORTED;
+		//Try to split it over several threads
+		bool sequential = true;
+		JpegLayout layout;
+		if( parallel && direct != QImage::Format_Invalid && !cache.is_scaled()
+			&&	layout.parse( data, length )
+			&&	layout.width == jpeg.cinfo.image_width && layout.height == jpeg.cinfo.image_height
+			){
+			QImage frame;
+			auto err = readParallel( data, layout, direct, cancel, frame );
+			if( err == ERROR_CANCELLED )
+				return err;
+			if( err == ERROR_NONE ){
+				cache.add_frame( frame, 0 );
+				sequential = false;
+			}
 		}
-		QImage frame( jpeg.cinfo.output_width, jpeg.cinfo.output_height, QImage::Format_RGB32 );
 		
-		//Read image
-		auto buffer = std::make_unique<JSAMPLE[]>( jpeg.bytesPerLine() );
-		JSAMPLE* arr[1] = { buffer.get() };
-		while( jpeg.cinfo.output_scanline < jpeg.cinfo.output_height ){
-			auto out = (QRgb*)frame.scanLine( jpeg.cinfo.output_scanline );
-			jpeg_read_scanlines( &jpeg.cinfo, arr, 1 );
+		if( sequential ){
+			//Progressive files can be shown after each scan
+			bool progressive = jpeg_has_multiple_scans( &jpeg.cinfo );
+			jpeg.cinfo.buffered_image = progressive;
+			jpeg_start_decompress( &jpeg.cinfo );
 			
-			if( is_gray )
-				for( unsigned ix=0; ix<jpeg.cinfo.output_width; ix++ )
-					out[ix] = qRgb( buffer[ix], buffer[ix], buffer[ix] );
-			else
-				for( unsigned ix=0; ix<jpeg.cinfo.output_width; ix++ )
-					out[ix] = qRgb( buffer[ix*3+0], buffer[ix*3+1], buffer[ix*3+2] );
+			bool convert = direct == QImage::Format_Invalid;
+			if( convert && jpeg.cinfo.out_color_components != 1 && jpeg.cinfo.out_color_components != 3 )
+				return ERROR_UNSUPPORTED;
+			QImage frame( jpeg.cinfo.output_width, jpeg.cinfo.output_height, convert ? QImage::Format_RGB32 : direct );
+			
+			//Get the rows before sharing the image, as scanLine() would detach it afterwards
+			std::vector<JSAMPROW> rows;
+			rows.reserve( frame.height() );
+			for( int iy=0; iy<frame.height(); iy++ )
+				rows.push_back( frame.scanLine( iy ) );
+			cache.add_partial_frame( frame, 0 );
+			
+			auto err = progressive
+				?	readProgressive( jpeg, cache, rows, convert, cancel )
+				:	readPass( jpeg, cache, rows, convert, true, cancel );
+			if( err != AReader::ERROR_NONE )
+				return err;
 		}
 		
 		//Check all markers
@@ -158,10 +617,6 @@ AReader::Error ReaderJpeg::read( imageCache &cache, const uint8_t* data, unsigne
 				
 				cache.set_orientation( exif.get_orientation() );
 				
-				//Read thumbnail
-				cache.thumbnail = exif.get_thumbnail();
-				//TODO: We actually want to read this BEFORE the full image ;)
-				
 				//TODO: Actually do something with this info. Perhaps check for a profile as well!
 			}
 			/* Save data to file for debugging
@@ -170,9 +625,10 @@ AReader::Error ReaderJpeg::read( imageCache &cache, const uint8_t* data, unsigne
 			f.write( (char*)marker->data, marker->data_length );
 			//*/
 		}
-		jpeg_finish_decompress( &jpeg.cinfo );
-		
-		cache.add_frame( frame, 0 );
+		if( sequential ){
+			jpeg_finish_decompress( &jpeg.cinfo );
+			cache.finish_partial_frame();
+		}
 		
 		//Cleanup and return
 		cache.set_fully_loaded();
@@ -22,11 +22,23 @@
 #include <QStringList>
 
 class ReaderJpeg: public AReader{
+	private:
+		bool direct_output;
+		bool parallel;
 	
 	public:
+		/** @param direct_output Let libjpeg write straight into the QImage if
+		 *  supported, instead of converting each pixel.
+		 *  @param parallel Decode files with restart markers on several threads */
+		explicit ReaderJpeg( bool direct_output=true, bool parallel=true )
+			:	direct_output(direct_output), parallel(parallel) { }
+		
 		QList<QString> extensions() const{ return QStringList() << "jpg" << "jpeg"; }
-		virtual Error read( imageCache &cache, const uint8_t* data, unsigned length, QString format ) const;
+		QList<Signature> signatures() const{ return { { 0, "\xff\xd8\xff", "jpg" } }; }
+		virtual Error read( imageCache &cache, const uint8_t* data, unsigned length, QString format, const CancelToken& cancel, QSize target ) const;
 		virtual bool can_read( const uint8_t* data, unsigned length, QString format ) const;
+		virtual Error probe( ImageInfo& info, const uint8_t* data, unsigned length, QString format ) const;
+		virtual QImage thumbnail( const uint8_t* data, unsigned length, QString format ) const;
 	
 };
 
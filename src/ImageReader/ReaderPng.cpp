@@ -17,12 +17,17 @@
 
 #include "ReaderPng.hpp"
 #include "AnimCombiner.hpp"
+#include "KeyframeSource.hpp"
+#include "../meta.h"
 
 #include <QImage>
 #include <QPainter>
+#include <QVector>
 #include <png.h>
+#include <zlib.h>
 #include <cstring>
 #include <cmath>
+#include <memory>
 #include <vector>
 
 
@@ -57,6 +62,9 @@ class PngInfo{
 		png_infop  info{ nullptr };
 		QImage frame;
 		std::vector<png_bytep> row_pointers;
+		const CancelToken* cancel{ nullptr };
+		imageCache* progress{ nullptr }; //Publish rows while reading if set
+		QVector<QRgb> colors; //Color table for Format_Indexed8
 		
 	public:
 		PngInfo(){
@@ -72,15 +80,37 @@ class PngInfo{
 	public:
 		void read( unsigned w, unsigned h, QImage::Format f, bool update ){
 			frame = QImage( w, h, f );
+			if( f == QImage::Format_Indexed8 )
+				frame.setColorTable( colors );
 			row_pointers.clear();
 			row_pointers.reserve( h );
 			for( unsigned i=0; i<h; i++ )
 				row_pointers.push_back( (png_bytep)frame.scanLine( i ) );
 			
+			int passes = png_set_interlace_handling( png );
 			if( update )
 				png_read_update_info( png, info );
 			static_assert( sizeof(png_byte) == sizeof(uint8_t), "png_byte must be 8bit" );
-			png_read_image( png, row_pointers.data() );
+			
+			//Row pointers are obtained already, so it is safe to share it now
+			if( progress )
+				progress->add_partial_frame( frame, 0 );
+			
+			//Read row by row, so we can stop if the image is no longer wanted.
+			//Rows are read in 'rectangle' mode, so Adam7 passes fill the rows not
+			//yet decoded with a blocky approximation which later passes refine.
+			for( int pass=0; pass<passes; pass++ )
+				for( unsigned iy=0; iy<h; iy++ ){
+					if( cancel && cancel->isCancelled() )
+						png_error( png, "Reading cancelled" ); //Jumps to the setjmp handler
+					png_read_row( png, nullptr, row_pointers[iy] );
+					
+					if( progress )
+						progress->set_partial_progress( pass == 0 ? iy+1 : h );
+				}
+			
+			if( progress )
+				progress->finish_partial_frame();
 		}
 		
 	public:
@@ -141,17 +171,41 @@ static void readGray( PngInfo& info, unsigned width, unsigned height, bool updat
 }
 #endif
 
-static void readPaletted( PngInfo& info, unsigned width, unsigned height, bool update ){
+static void readPaletted( PngInfo& info, unsigned width, unsigned height, bool update, bool keep_palette ){
 	Q_ASSERT( info.isPalette() );
 	
-	//TODO: support paletted images
-	png_set_palette_to_rgb( info.png );
-	readRgb( info, width, height, update );
+	if( !keep_palette ){
+		png_set_palette_to_rgb( info.png );
+		readRgb( info, width, height, update );
+		return;
+	}
+	
+	png_colorp palette = nullptr;
+	int palette_size = 0;
+	png_get_PLTE( info.png, info.info, &palette, &palette_size );
+	
+	png_bytep trans = nullptr;
+	int trans_size = 0;
+	if( png_get_valid( info.png, info.info, PNG_INFO_tRNS ) )
+		png_get_tRNS( info.png, info.info, &trans, &trans_size, nullptr );
+	
+	//Indexes outside the palette are invalid, make them opaque black.
+	//Kept in 'info', as libpng errors longjmp past the destructors of locals
+	info.colors.fill( qRgb( 0,0,0 ), 1 << info.bitDepth() );
+	for( int i=0; i<palette_size && i<info.colors.size(); i++ ){
+		auto alpha = i < trans_size ? trans[i] : 255;
+		info.colors[i] = qRgba( palette[i].red, palette[i].green, palette[i].blue, alpha );
+	}
+	
+	//Use one byte per pixel for 1, 2 and 4 bit images
+	info.force8bit();
+	info.read( width, height, QImage::Format_Indexed8, update );
 }
 
-static void readImage( PngInfo& info, unsigned width, unsigned height, bool update=true ){
+/** @param keep_palette Read paletted images as Format_Indexed8, instead of expanding them */
+static void readImage( PngInfo& info, unsigned width, unsigned height, bool update=true, bool keep_palette=false ){
 	if( info.isPalette() )
-		readPaletted( info, width, height, update );
+		readPaletted( info, width, height, update, keep_palette );
 #if QT_VERSION >= 0x050500
 	else if( info.isGray() )
 		readGray( info, width, height, update );
@@ -161,6 +215,24 @@ static void readImage( PngInfo& info, unsigned width, unsigned height, bool upda
 }
 
 #ifdef PNG_APNG_SUPPORTED
+static BlendMode pngBlend( png_byte blend_op )
+	{ return blend_op == PNG_BLEND_OP_SOURCE ? BlendMode::REPLACE : BlendMode::OVERLAY; }
+
+static DisposeMode pngDispose( png_byte dispose_op ){
+	switch( dispose_op ){
+		case PNG_DISPOSE_OP_NONE:       return DisposeMode::NONE;
+		case PNG_DISPOSE_OP_BACKGROUND: return DisposeMode::BACKGROUND;
+		case PNG_DISPOSE_OP_PREVIOUS:   return DisposeMode::REVERT;
+		default: return DisposeMode::NONE; //TODO: add error
+	}
+}
+
+static int apngDelay( png_uint_16 delay_num, png_uint_16 delay_den ){
+	delay_den = delay_den==0 ? 100 : delay_den;
+	int delay = std::ceil( (double)delay_num / delay_den * 1000 );
+	return delay == 0 ? 1 : delay; //Fastest speed we support
+}
+
 static void readAnimated( imageCache &cache, PngInfo& png ){
 	auto width  = png.width();
 	auto height = png.height();
@@ -204,27 +276,248 @@ static void readAnimated( imageCache &cache, PngInfo& png ){
 		
 		readImage( png, width, height, i==0 );
 		
-		//Calculate delay
-		delay_den = delay_den==0 ? 100 : delay_den;
-		unsigned delay = std::ceil( (double)delay_num / delay_den * 1000 );
-		if( delay == 0 )
-			delay = 1; //Fastest speed we support
-		
 		//Compose and add
-		auto blend_mode = blend_op == PNG_BLEND_OP_SOURCE ? BlendMode::REPLACE : BlendMode::OVERLAY;
-		auto dispose_mode = [=](){ switch( dispose_op ){
-				case PNG_DISPOSE_OP_NONE:       return DisposeMode::NONE;
-				case PNG_DISPOSE_OP_BACKGROUND: return DisposeMode::BACKGROUND;
-				case PNG_DISPOSE_OP_PREVIOUS:   return DisposeMode::REVERT;
-				default: return DisposeMode::NONE; //TODO: add error
-			} }();
-		QImage output = combiner.combine( png.frame, x_offset, y_offset, blend_mode, dispose_mode );
-		cache.add_frame( output, delay );
+		QImage output = combiner.combine( png.frame, x_offset, y_offset, pngBlend( blend_op ), pngDispose( dispose_op ) );
+		cache.add_frame( output, apngDelay( delay_num, delay_den ), combiner.changedArea() );
 	}
 }
+
+
+static uint32_t readUint32( const uint8_t* data )
+	{ return (uint32_t(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3]; }
+static uint16_t readUint16( const uint8_t* data )
+	{ return (data[0] << 8) | data[1]; }
+
+static void writeUint32( uint8_t* out, uint32_t value ){
+	for( int i=0; i<4; i++ )
+		out[i] = value >> (24 - i*8);
+}
+
+static void appendChunk( QByteArray& png, const char* type, const uint8_t* data, unsigned length ){
+	uint8_t number[4];
+	writeUint32( number, length );
+	png.append( (const char*)number, 4 );
+	
+	auto start = png.size();
+	png.append( type, 4 );
+	png.append( (const char*)data, length );
+	
+	writeUint32( number, crc32( 0, (const Bytef*)png.constData() + start, length + 4 ) );
+	png.append( (const char*)number, 4 );
+}
+
+struct ApngFrame{
+	uint32_t width, height, x, y;
+	int delay;
+	DisposeMode dispose;
+	BlendMode blend;
+	std::vector<std::pair<unsigned, unsigned>> data; //Offset and length of the compressed image data
+};
+
+struct ApngState{
+	AnimCombiner combiner{ QImage() };
+};
+
+/** Decodes frames on demand for animations too large to keep in memory.
+ *  libpng can only read APNG frames in order, so each frame is instead
+ *  rewritten as a separate PNG image and decoded on its own. */
+class ApngFrameSource : public KeyframeSource<ApngState>{
+	private:
+		QByteArray file; //Own copy, as the mapped file is closed after loading
+		unsigned ihdr{ 0 }; //Offset of the IHDR chunk data
+		std::vector<std::pair<unsigned, unsigned>> headers; //Chunks which must be before the image data
+		std::vector<ApngFrame> frames;
+		
+		const uint8_t* bytes() const{ return (const uint8_t*)file.constData(); }
+		
+		bool isType( unsigned pos, const char* type ) const
+			{ return std::memcmp( bytes() + pos + 4, type, 4 ) == 0; }
+		
+		void index(){
+			unsigned pos = 8;
+			bool image_data = false;
+			while( pos + 12 <= unsigned(file.size()) ){
+				auto length = readUint32( bytes() + pos );
+				if( length > file.size() - pos - 12 )
+					break; //Truncated
+				auto body = pos + 8;
+				
+				if( isType( pos, "IHDR" ) && length == 13 )
+					ihdr = body;
+				else if( isType( pos, "fcTL" ) && length >= 26 ){
+					auto fctl = bytes() + body;
+					auto dispose = fctl[24], blend = fctl[25];
+					frames.push_back( { readUint32( fctl+4 ), readUint32( fctl+8 ), readUint32( fctl+12 ), readUint32( fctl+16 )
+						,	apngDelay( readUint16( fctl+20 ), readUint16( fctl+22 ) ), pngDispose( dispose ), pngBlend( blend ), {} } );
+				}
+				else if( isType( pos, "IDAT" ) ){
+					image_data = true;
+					//Without a fcTL before it, the default image is not a part of the animation
+					if( !frames.empty() )
+						frames.back().data.emplace_back( body, length );
+				}
+				else if( isType( pos, "fdAT" ) && length > 4 && !frames.empty() )
+					frames.back().data.emplace_back( body + 4, length - 4 ); //Skip the sequence number
+				else if( isType( pos, "IEND" ) )
+					break;
+				else if( !image_data && !isType( pos, "acTL" ) )
+					headers.emplace_back( pos, length + 12 );
+				
+				pos += length + 12;
+			}
+			
+			//Drop frames cut off by truncation
+			while( !frames.empty() && frames.back().data.empty() )
+				frames.pop_back();
+		}
+		
+		/** Create a PNG file only containing 'frame' */
+		QByteArray createPng( const ApngFrame& frame ) const{
+			QByteArray png( file.constData(), 8 );
+			
+			uint8_t header[13];
+			std::memcpy( header, bytes() + ihdr, 13 );
+			writeUint32( header + 0, frame.width );
+			writeUint32( header + 4, frame.height );
+			appendChunk( png, "IHDR", header, 13 );
+			
+			for( auto chunk : headers )
+				png.append( file.constData() + chunk.first, chunk.second );
+			for( auto chunk : frame.data )
+				appendChunk( png, "IDAT", bytes() + chunk.first, chunk.second );
+			appendChunk( png, "IEND", nullptr, 0 );
+			return png;
+		}
+		
+	protected:
+		bool decodeNext( unsigned index, ApngState& state, QImage& output ) override{
+			auto& frame = frames[index];
+			auto data = createPng( frame );
+			
+			PngInfo png;
+			if( !png.isValid() || setjmp( png_jmpbuf( png.png ) ) )
+				return false;
+			
+			MemStream stream = { 8, (const uint8_t*)data.constData(), unsigned(data.size()) };
+			png_set_read_fn( png.png, &stream, read_from_mem_stream );
+			png_set_sig_bytes( png.png, 8 );
+			png_read_info( png.png, png.info );
+			readImage( png, png.width(), png.height() );
+			
+			output = state.combiner.combine( png.frame, frame.x, frame.y, frame.blend, frame.dispose );
+			return true;
+		}
+		
+	public:
+		ApngFrameSource( const uint8_t* data, unsigned length, QSize size, unsigned interval )
+			:	KeyframeSource( interval ), file( (const char*)data, length ) {
+			index();
+			
+			ApngState start;
+			QImage canvas( size, QImage::Format_ARGB32 );
+			canvas.fill( qRgba( 0,0,0,0 ) );
+			start.combiner = AnimCombiner( canvas );
+			setStart( start );
+		}
+		
+		bool isValid() const{ return ihdr != 0; }
+		unsigned frameCount() const{ return frames.size(); }
+		
+		std::vector<int> delays() const{
+			std::vector<int> delays;
+			for( auto& frame : frames )
+				delays.push_back( frame.delay );
+			return delays;
+		}
+};
 #endif
 
-AReader::Error ReaderPng::read( imageCache &cache, const uint8_t* data, unsigned length, QString format ) const{
+AReader::Error ReaderPng::probe( ImageInfo& info, const uint8_t* data, unsigned length, QString format ) const{
+	if( !can_read( data, length, format ) )
+		return ERROR_TYPE_UNKNOWN;
+	
+	PngInfo png;
+	if( !png.isValid() )
+		return ERROR_INITIALIZATION;
+	
+	if( setjmp( png_jmpbuf( png.png ) ) )
+		return ERROR_FILE_BROKEN;
+	
+	//Only read the chunks before the image data
+	MemStream stream = { 8, data, length };
+	png_set_read_fn( png.png, &stream, read_from_mem_stream );
+	png_set_sig_bytes( png.png, 8 );
+	png_read_info( png.png, png.info );
+	
+	info.size = QSize( png.width(), png.height() );
+	info.bit_depth = png.bitDepth();
+	info.frames = 1;
+	info.has_profile = png_get_valid( png.png, png.info, PNG_INFO_iCCP );
+#ifdef PNG_APNG_SUPPORTED
+	if( png_get_valid( png.png, png.info, PNG_INFO_acTL ) ){
+		info.animated = true;
+		info.frames = png_get_num_frames( png.png, png.info );
+		if( png_get_first_frame_is_hidden( png.png, png.info ) )
+			info.frames--;
+	}
+#endif
+	
+	return ERROR_NONE;
+}
+
+QImage ReaderPng::thumbnail( const uint8_t* data, unsigned length, QString format ) const{
+#ifdef PNG_eXIf_SUPPORTED
+	if( !can_read( data, length, format ) )
+		return {};
+	
+	PngInfo png;
+	if( !png.isValid() || setjmp( png_jmpbuf( png.png ) ) )
+		return {};
+	
+	MemStream stream = { 8, data, length };
+	png_set_read_fn( png.png, &stream, read_from_mem_stream );
+	png_set_sig_bytes( png.png, 8 );
+	png_read_info( png.png, png.info );
+	
+	png_uint_32 exif_length = 0;
+	png_bytep exif = nullptr;
+	if( png_get_eXIf_1( png.png, png.info, &exif_length, &exif ) )
+		return meta::get_tiff_thumbnail( exif, exif_length );
+#else
+	(void)data; (void)length; (void)format;
+#endif
+	return {};
+}
+
+#ifdef PNG_APNG_SUPPORTED
+/** Decode large animations on demand, instead of keeping every frame
+ *  @return false if the animation should be read normally */
+static bool readStreamed( imageCache& cache, PngInfo& png, const uint8_t* data, unsigned length ){
+	unsigned frames = png_get_num_frames( png.png, png.info );
+	if( png_get_first_frame_is_hidden( png.png, png.info ) )
+		frames--;
+	
+	auto limit = imageCache::get_memory_limit();
+	QSize size( png.width(), png.height() );
+	qint64 frame_bytes = qint64( size.width() ) * size.height() * 4;
+	if( frames < 2 || frame_bytes * frames <= limit )
+		return false;
+	
+	auto interval = ApngFrameSource::intervalFor( frames, frame_bytes, limit / 2 );
+	auto source = std::make_unique<ApngFrameSource>( data, length, size, interval );
+	if( !source->isValid() || source->frameCount() != frames )
+		return false;
+	
+	unsigned repeats = png_get_num_plays( png.png, png.info );
+	cache.set_info( frames, true, repeats>0 ? repeats-1 : -1 );
+	auto delays = source->delays();
+	cache.set_frame_source( std::move( source ), size, std::move( delays ) );
+	cache.set_fully_loaded();
+	return true;
+}
+#endif
+
+AReader::Error ReaderPng::read( imageCache &cache, const uint8_t* data, unsigned length, QString format, const CancelToken& cancel, QSize ) const{
 	if( !can_read( data, length, format ) )
 		return ERROR_TYPE_UNKNOWN;
 	
@@ -232,10 +525,11 @@ AReader::Error ReaderPng::read( imageCache &cache, const uint8_t* data, unsigned
 	PngInfo png;
 	if( !png.isValid() )
 		return ERROR_INITIALIZATION;
+	png.cancel = &cancel;
 	
 	//Handle errors
 	if( setjmp( png_jmpbuf( png.png ) ) )
-		return ERROR_FILE_BROKEN;
+		return cancel.isCancelled() ? ERROR_CANCELLED : ERROR_FILE_BROKEN;
 	
 	//Prepare reading
 	MemStream stream = { 8, data, length };
@@ -245,14 +539,19 @@ AReader::Error ReaderPng::read( imageCache &cache, const uint8_t* data, unsigned
 	//Start reading
 	png_read_info( png.png, png.info );
 #ifdef PNG_APNG_SUPPORTED
-	if( png_get_valid( png.png, png.info, PNG_INFO_acTL ) )
+	if( png_get_valid( png.png, png.info, PNG_INFO_acTL ) ){
+		if( readStreamed( cache, png, data, length ) )
+			return ERROR_NONE;
 		readAnimated( cache, png );
+		if( cancel.isCancelled() )
+			return ERROR_CANCELLED;
+	}
 	else
 #endif
 	{
 		cache.set_info( 1 );
-		readImage( png, png.width(), png.height() );
-		cache.add_frame( png.frame, 0 );
+		png.progress = &cache;
+		readImage( png, png.width(), png.height(), true, true );
 	}
 	
 	//Cleanup and return
@@ -25,8 +25,11 @@ class ReaderPng: public AReader{
 	
 	public:
 		QList<QString> extensions() const{ return QStringList() << "png" << "apng"; }
-		virtual Error read( imageCache &cache, const uint8_t* data, unsigned length, QString format ) const;
+		QList<Signature> signatures() const{ return { { 0, "\x89PNG\r\n\x1a\n", "png" } }; }
+		virtual Error read( imageCache &cache, const uint8_t* data, unsigned length, QString format, const CancelToken& cancel, QSize target ) const;
 		virtual bool can_read( const uint8_t* data, unsigned length, QString format ) const;
+		virtual Error probe( ImageInfo& info, const uint8_t* data, unsigned length, QString format ) const;
+		virtual QImage thumbnail( const uint8_t* data, unsigned length, QString format ) const;
 	
 };
 
@@ -21,6 +21,7 @@
 
 #include <QImageReader>
 #include <QBuffer>
+#include <cstring>
 
 QList<QString> ReaderQt::extensions() const{
 	QList<QString> exts;
@@ -29,15 +30,108 @@ QList<QString> ReaderQt::extensions() const{
 	return exts;
 }
 
+static const struct{
+	unsigned offset;
+	const char* magic;
+	int length;
+	const char* format;
+} qt_signatures[] = {
+		{ 0, "BM", 2, "bmp" }
+	,	{ 0, "II*\0", 4, "tiff" }
+	,	{ 0, "MM\0*", 4, "tiff" }
+	,	{ 8, "WEBP", 4, "webp" }
+	,	{ 0, "GIF87a", 6, "gif" }
+	,	{ 0, "GIF89a", 6, "gif" }
+	,	{ 0, "\0\0\1\0", 4, "ico" }
+	,	{ 0, "\0\0\2\0", 4, "cur" }
+	,	{ 0, "icns", 4, "icns" }
+	,	{ 0, "DDS ", 4, "dds" }
+	,	{ 0, "8BPS", 4, "psd" }
+	,	{ 0, "\0\0\0\x0CjP  \r\n\x87\n", 12, "jp2" }
+	,	{ 0, "/* XPM */", 9, "xpm" }
+	,	{ 0, "P1", 2, "pbm" }
+	,	{ 0, "P4", 2, "pbm" }
+	,	{ 0, "P2", 2, "pgm" }
+	,	{ 0, "P5", 2, "pgm" }
+	,	{ 0, "P3", 2, "ppm" }
+	,	{ 0, "P6", 2, "ppm" }
+	};
+
+QList<Signature> ReaderQt::signatures() const{
+	//Only announce the formats which have a plugin installed
+	auto supported = QImageReader::supportedImageFormats();
+	QList<Signature> sigs;
+	for( auto& sig : qt_signatures )
+		if( supported.contains( sig.format ) )
+			sigs.append( Signature{ sig.offset, QByteArray( sig.magic, sig.length ), sig.format } );
+	return sigs;
+}
+
+/* Wraps the data without copying it, so 'data' must outlive the QByteArray */
 static QByteArray fromData( const uint8_t* data, unsigned length )
-	{ return QByteArray( reinterpret_cast<const char*>( data ), length ); }
+	{ return QByteArray::fromRawData( reinterpret_cast<const char*>( data ), length ); }
 
-AReader::Error ReaderQt::read( imageCache &cache, const uint8_t* data, unsigned length, QString format ) const{
+#if QT_VERSION >= 0x050500
+static Orientation convertTransformation( QImageIOHandler::Transformations transform ){
+	//Qt mirrors before rotating, while we rotate first
+	bool rotate = transform.testFlag( QImageIOHandler::TransformationRotate90 );
+	bool mirror = transform.testFlag( QImageIOHandler::TransformationMirror );
+	bool flip   = transform.testFlag( QImageIOHandler::TransformationFlip );
+	return { int8_t(rotate ? 1 : 0), rotate ? mirror : flip, rotate ? flip : mirror };
+}
+#endif
+
+static int formatDepth( QImage::Format format ){
+	switch( format ){
+		case QImage::Format_Invalid: return 0;
+		case QImage::Format_Mono:
+		case QImage::Format_MonoLSB: return 1;
+		default: return 8;
+	}
+}
+
+AReader::Error ReaderQt::probe( ImageInfo& info, const uint8_t* data, unsigned length, QString format ) const{
+	QByteArray byte_data = fromData( data, length );
+	QBuffer buffer( &byte_data );
+	QImageReader image_reader( &buffer, format.toLocal8Bit() );
+	if( !image_reader.canRead() )
+		return ERROR_TYPE_UNKNOWN;
+	
+	info.size = image_reader.size();
+	info.frames = image_reader.imageCount();
+	info.animated = image_reader.supportsAnimation();
+	info.bit_depth = formatDepth( image_reader.imageFormat() );
+#if QT_VERSION >= 0x050500
+	info.orientation = convertTransformation( image_reader.transformation() );
+#endif
+	
+	return ERROR_NONE;
+}
+
+QImage ReaderQt::thumbnail( const uint8_t* data, unsigned length, QString ) const{
+	//TIFF files can contain an EXIF thumbnail in the second IFD
+	if( length >= 4 && ( std::memcmp( data, "II*\0", 4 ) == 0 || std::memcmp( data, "MM\0*", 4 ) == 0 ) )
+		return meta::get_tiff_thumbnail( data, length );
+	return {};
+}
+
+AReader::Error ReaderQt::read( imageCache &cache, const uint8_t* data, unsigned length, QString format, const CancelToken& cancel, QSize target ) const{
 	QByteArray byte_data = fromData( data, length );
 	QBuffer buffer( &byte_data );
 	QImageReader image_reader( &buffer, format.toLocal8Bit() );
 	
 	if( image_reader.canRead() ){
+		//Let the plugin decode stills at a reduced size, if it can do so cheaply
+		auto size = image_reader.size();
+		if( target.isValid() && size.isValid() && image_reader.imageCount() <= 1
+			&&	image_reader.supportsOption( QImageIOHandler::ScaledSize ) ){
+			auto scaled = size.scaled( target, Qt::KeepAspectRatio );
+			if( scaled.width() < size.width() ){
+				image_reader.setScaledSize( scaled );
+				cache.set_scaled( size );
+			}
+		}
+		
 		//Read first image
 		QImage frame;
 		if( !image_reader.read( &frame ) )
@@ -46,9 +140,15 @@ AReader::Error ReaderQt::read( imageCache &cache, const uint8_t* data, unsigned
 		int frame_amount = image_reader.imageCount();
 		auto isAnim = image_reader.supportsAnimation();
 		cache.set_info( frame_amount, isAnim, isAnim ? image_reader.loopCount() : -1 );
+#if QT_VERSION >= 0x050500
+		cache.set_orientation( convertTransformation( image_reader.transformation() ) );
+#endif
 		
 		int current_frame = 1;
 		do{
+			if( cancel.isCancelled() )
+				return ERROR_CANCELLED;
+			
 			cache.add_frame( frame, image_reader.nextImageDelay() );
 			if( frame_amount > 0 && current_frame >= frame_amount )
 				break;
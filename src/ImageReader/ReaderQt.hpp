@@ -25,8 +25,11 @@ class ReaderQt: public AReader{
 	
 	public:
 		QList<QString> extensions() const;
-		virtual Error read( imageCache &cache, const uint8_t* data, unsigned length, QString format ) const;
+		QList<Signature> signatures() const;
+		virtual Error read( imageCache &cache, const uint8_t* data, unsigned length, QString format, const CancelToken& cancel, QSize target ) const;
 		virtual bool can_read( const uint8_t* data, unsigned length, QString format ) const;
+		virtual Error probe( ImageInfo& info, const uint8_t* data, unsigned length, QString format ) const;
+		virtual QImage thumbnail( const uint8_t* data, unsigned length, QString format ) const;
 	
 };
 
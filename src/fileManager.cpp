@@ -19,16 +19,17 @@
 
 #include "viewer/imageCache.h"
 #include "ImageReader/ImageReader.hpp"
+#include "FileSystem/DirectoryIndex.hpp"
 
 #include <QDir>
 #include <QStringList>
 #include <QCoreApplication>
-#include <QTime>
 #include <QDirIterator>
+#include <QDebug>
+#include <QtConcurrent>
 #include <algorithm>
-
-#include <QMutex>
-#include <QMutexLocker>
+#include <numeric>
+#include <cstdlib>
 
 #include <qglobal.h>
 #ifdef Q_OS_WIN
@@ -37,9 +38,19 @@
 #endif
 
 
-fileManager::fileManager( const QSettings& settings ) : settings( settings ), have_ext( ImageReader().supportedExtensions() ){
-	connect( &loader, SIGNAL( image_fetched() ), this, SLOT( loading_handler() ) );
-	connect( &watcher, SIGNAL( directoryChanged( QString ) ), this, SLOT( dir_modified() ) );
+fileManager::fileManager( const QSettings& settings )
+	:	settings( settings )
+	,	have_ext( ImageReader().supportedExtensions() )
+	,	previews( std::make_shared<previewCache>( settings.value( "loading/preview-cache", 0 ).toLongLong() * 1024 * 1024 ) )
+	,	loader( settings.value( "loading/threads", 0 ).toInt(), previews.get() )
+	{
+	connect( &watcher, SIGNAL( reset() ), this, SLOT( dir_modified() ) );
+	connect( &watcher, SIGNAL( changed(QStringList,QStringList) ), this, SLOT( files_changed(QStringList,QStringList) ) );
+	connect( &scan_watcher, SIGNAL( finished() ), this, SLOT( scan_finished() ) );
+	qRegisterMetaType<imageCache*>( "imageCache*" );
+	connect( &loader, SIGNAL( image_loaded(imageCache*) ), this, SLOT( full_resolution_loaded(imageCache*) ) );
+	connect( &loader, SIGNAL( image_loaded(imageCache*) ), this, SLOT( store_preview(imageCache*) ) );
+	connect( &loader, SIGNAL( image_loaded(imageCache*) ), this, SLOT( image_loaded(imageCache*) ) );
 	
 	bool hidden_default = false;
 	bool extension_default = false;
@@ -59,6 +70,9 @@ fileManager::fileManager( const QSettings& settings ) : settings( settings ), ha
 	recursive = settings.value( "loading/recursive", false ).toBool();
 	wrap = settings.value( "loading/wrap", true ).toBool();
 	buffer_max = settings.value( "loading/buffer-max", 3 ).toInt();
+	memory_budget = settings.value( "loading/memory-budget", 2048 ).toLongLong() * 1024 * 1024;
+	prepare_frames = settings.value( "loading/prepare-frames", true ).toBool();
+	imageCache::set_memory_limit( settings.value( "loading/animation-memory", 1024 ).toLongLong() * 1024 * 1024 );
 	
 	//Set collation settings
 	collator.setNumericMode( settings.value( "loading/natural-number-order", false ).toBool() );
@@ -68,6 +82,21 @@ fileManager::fileManager( const QSettings& settings ) : settings( settings ), ha
 	collator.setIgnorePunctuation( punctuation );
 }
 
+fileManager::~fileManager(){
+	//Opt-in, the counters are otherwise available through prefetch_statistics() and colorManager::statistics()
+	if( settings.value( "debug/statistics", false ).toBool() ){
+		if( planner.statistics().total() > 0 )
+			qDebug() << planner.summary();
+		auto manager = imageCache::get_manager();
+		if( manager && manager->statistics().hits + manager->statistics().misses > 0 )
+			qDebug() << manager->summary();
+	}
+	clear_cache();
+	scan_watcher.waitForFinished();
+	for( auto retired : retired_scans )
+		retired->waitForFinished();
+}
+
 void fileManager::set_files( QFileInfo file ){
 	//Stop if it does not support file
 	if( !file.exists() || !supports_extension( file.fileName() ) ){
@@ -80,62 +109,223 @@ void fileManager::set_files( QFileInfo file ){
 	force_hidden = file.isHidden();
 	
 	//Begin caching
-	if( dir == file.dir().absolutePath() )
-		goto_file( find_file( { file.fileName(), collator } ) );
+	if( dir == file.dir().absolutePath() && !scanning )
+		goto_file( find_file( { name_of( file ), collator } ) );
 	else{
 		//Start loading image instantly
 		auto img = loader.load_image( file.absoluteFilePath() );
 		
-		load_files( file.dir() );
-		
-		current_file = index_of( {	recursive ? file.filePath() : file.fileName(), collator });
-		
+		//Show it as the only file, until the rest of the directory have been listed
+		clear_cache();
+		dir = file.dir().absolutePath();
+		watcher.watch( dir, recursive );
+		files.push_back( { name_of( file ), collator } );
+		current_file = 0;
 		files[current_file].cache = std::move(img);
+		charge( files[current_file].name, files[current_file].cache );
 		emit position_changed();
 		emit file_changed();
 		
-		if( !files[current_file].cache )
-			load_image( current_file );
+		start_scan();
 		loading_handler();
 	}
 }
 
-void fileManager::load_files( QDir current_dir ){
-	//If hidden, include hidden files
-	QDir::Filters filters = QDir::Files;
-	if( show_hidden || force_hidden )
-		filters |= QDir::Hidden;
+/** @return The name of 'file' in 'files', in the same form as the listing gives it */
+QString fileManager::name_of( QFileInfo file ) const{
+	if( !recursive )
+		return file.fileName();
+	QDir root( dir );
+	return root.filePath( root.relativeFilePath( file.absoluteFilePath() ) ); //As in enumerate_indexed()
+}
+
+/** Lists the supported files, sorted. Can be run in another thread.
+ *  When recursive, the sub-directories are returned in 'directories'. */
+QList<fileManager::File> fileManager::enumerate_files( QDir current_dir, QDir::Filters filters, bool recursive
+	,	const ExtensionChecker& checker, const QCollator& collator, const CancelToken& cancel
+	,	QStringList& directories ){
+	if( recursive )
+		return enumerate_indexed( current_dir, filters, checker, collator, cancel, directories );
 	current_dir.setFilter( filters );
 	
-	//Begin caching
-	clear_cache();
-	
 	//This folder, or all sub-folders as well
+	QList<File> found;
 	auto flags = recursive ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags;
 	QDirIterator it( current_dir, flags );
-	while( it.hasNext() ){
+	while( it.hasNext() && !cancel.isCancelled() ){
 		it.next();
 		auto file = recursive ? it.filePath() : it.fileName();
-		if( supports_extension( file ) )
-			files.push_back( {file, collator} );
+		if( checker.matches( file ) )
+			found.push_back( {file, collator} );
 	}
 	
-	std::sort( files.begin(), files.end() );
+	std::sort( found.begin(), found.end() );
+	return found;
+}
+
+/** Text identifying how 'collator' orders files */
+static QString sort_order( const QCollator& collator ){
+	return collator.locale().name()
+		+	( collator.numericMode() ? ":numeric" : "" )
+		+	( collator.caseSensitivity() == Qt::CaseSensitive ? ":case" : "" )
+		+	( collator.ignorePunctuation() ? ":punctuation" : "" );
+}
+
+QList<fileManager::File> fileManager::enumerate_indexed( QDir current_dir, QDir::Filters filters
+	,	const ExtensionChecker& checker, const QCollator& collator, const CancelToken& cancel
+	,	QStringList& directories ){
+	DirectoryIndex index( current_dir.absolutePath(), checker );
+	if( !index.update( cancel ) )
+		return {};
+	directories = index.directories();
+	
+	auto& entries = index.files();
+	QList<File> all;
+	all.reserve( entries.size() );
+	for( auto& entry : entries )
+		all.push_back( { current_dir.filePath( entry.path ), collator } );
+	
+	//Sorting is skipped if nothing changed since it was saved
+	auto order = sort_order( collator );
+	QVector<int> sorted( entries.size() );
+	std::iota( sorted.begin(), sorted.end(), 0 );
+	if( !index.isSorted( order ) ){
+		std::sort( sorted.begin(), sorted.end(), [&]( int a, int b ){ return all[a] < all[b]; } );
+		if( cancel.isCancelled() )
+			return {};
+		
+		QVector<DirectoryIndex::Entry> sorted_entries;
+		sorted_entries.reserve( entries.size() );
+		for( auto i : sorted )
+			sorted_entries.push_back( entries[i] );
+		QList<File> sorted_files;
+		sorted_files.reserve( all.size() );
+		for( auto i : sorted )
+			sorted_files.push_back( std::move( all[i] ) );
+		all = std::move( sorted_files );
+		index.setSorted( sorted_entries, order );
+	}
+	
+	if( filters & QDir::Hidden )
+		return all;
+	
+	QList<File> found;
+	for( int i=0; i<all.size(); i++ )
+		if( !index.files()[i].hidden )
+			found.push_back( std::move( all[i] ) );
+	return found;
+}
+
+void fileManager::start_scan(){
+	QDir::Filters filters = QDir::Files;
+	if( show_hidden || force_hidden )
+		filters |= QDir::Hidden;
 	
-	QString path = current_dir.absolutePath();
-	if( path != dir ){
-		dir = path;
-		watcher.addPath( dir );
+	//The thread gets its own copies, as this object might change meanwhile
+	scanning = true;
+	scan_outdated = false;
+	scan_cancel = CancelToken();
+	auto generation = scan_generation;
+	auto current_dir = QDir( dir );
+	auto scan_recursive = recursive;
+	auto checker = have_ext;
+	auto scan_collator = collator;
+	auto cancel = scan_cancel;
+	auto tree_watcher = &watcher; //addWatches() is thread safe, and the destructor waits for the scan
+	
+	//The scan being replaced might have added watches already, which must be handed back
+	if( scan_pending ){
+		auto retired = new QFutureWatcher<ScanResult>( this );
+		retired_scans << retired;
+		connect( retired, &QFutureWatcherBase::finished, this, [=](){
+				watcher.adoptWatches( retired->result().watches, false );
+				retired_scans.removeOne( retired );
+				retired->deleteLater();
+			} );
+		retired->setFuture( scan_watcher.future() );
 	}
+	scan_pending = true;
+	scan_watcher.setFuture( QtConcurrent::run( [=](){
+			QStringList directories;
+			auto found = enumerate_files( current_dir, filters, scan_recursive, checker, scan_collator, cancel, directories );
+			
+			//Watching a large tree is slow too, so it is done here instead of in DirectoryWatcher::watch()
+			QHash<int, QString> watches;
+			if( !cancel.isCancelled() )
+				watches = tree_watcher->addWatches( directories );
+			return ScanResult{ generation, found, watches };
+		} ) );
+}
+
+void fileManager::cancel_scan(){
+	scan_cancel.cancel();
+	scan_generation++;
+	scanning = false;
 }
 
-void fileManager::load_image( int pos ){
-	if( files[pos].cache )
+void fileManager::scan_finished(){
+	scan_pending = false;
+	auto result = scan_watcher.result();
+	bool current = result.generation == scan_generation && scanning;
+	watcher.adoptWatches( result.watches, current );
+	if( !current || !has_file() )
 		return;
+	scanning = false;
+	
+	//Keep what have been loaded while scanning
+	File old_file = files[current_file];
+	QList<File> old;
+	for( auto& file : files )
+		if( file.cache )
+			old << std::move( file );
+	
+	auto old_path = prefix() + old_file.name;
+	files = std::move( result.files );
+	if( index_of( old_file ) == -1 && QFileInfo( old_path ).exists() ){
+		//The listing might have missed it, if it was created while listing
+		auto pos = std::lower_bound( files.begin(), files.end(), old_file );
+		files.insert( pos, old_file );
+	}
+	
+	for( auto& elem : old ){
+		int new_index = index_of( elem );
+		if( new_index != -1 )
+			files[new_index] = std::move( elem );
+		else{
+			loader.cancel( elem.cache.get() );
+			uncharge( elem.cache );
+		}
+	}
+	
+	if( check_empty() )
+		return;
+	
+	//Stay at the same file, or the nearest one if it was deleted
+	current_file = find_file( old_file );
+	emit position_changed();
+	if( files[current_file] != old_file ){
+		emit file_changed();
+		if( !files[current_file].cache )
+			load_image( current_file );
+	}
+	loading_handler();
+	
+	if( scan_outdated )
+		dir_modified();
+}
+
+void fileManager::load_image( int pos, int priority ){
+	files[pos].last_used = ++use_counter;
+	if( files[pos].cache ){
+		//Already queued, but the distance to the current file might have changed
+		loader.set_priority( files[pos].cache.get(), priority );
+		return;
+	}
 	
 	//Check buffer first
 	auto it = std::find( buffer.begin(), buffer.end(), files[pos] );
 	if( it != buffer.end() ){
+		it->last_used = files[pos].last_used;
 		files[pos] = std::move(*it);
 		buffer.erase( it );
 		if( pos == current_file )
@@ -144,8 +334,9 @@ void fileManager::load_image( int pos ){
 	}
 	
 	//Load image
-	files[pos].cache = loader.load_image( file( pos ) );
-	if( files[pos].cache && pos == current_file )
+	files[pos].cache = loader.load_image( file( pos ), priority );
+	charge( files[pos].name, files[pos].cache );
+	if( pos == current_file )
 		emit file_changed();
 }
 
@@ -166,6 +357,10 @@ int fileManager::move( int offset ) const{
 
 void fileManager::goto_file( int index ){
 	if( has_file( index ) ){
+		if( index != current_file ){
+			cancel_full_resolution();
+			record_navigation( index );
+		}
 		current_file = index;
 		emit file_changed();
 		emit position_changed();
@@ -178,53 +373,228 @@ void fileManager::unload_image( int index ){
 	if( !has_file(index) || !files[index].cache )
 		return;
 	
+	//Stop loading it if it is not done yet, a partial image is not worth buffering
+	auto status = files[index].cache->get_status();
+	if( status != imageCache::LOADED && status != imageCache::INVALID ){
+		loader.cancel( files[index].cache.get() );
+		uncharge( files[index].cache );
+		files[index].cache = {};
+		return;
+	}
+	
 	//Save cache in buffer
 	buffer << std::move( files[index] );
 	files[index].cache = {};
 	
 	//Remove if there becomes too many
-	while( (unsigned)buffer.size() > buffer_max )
+	while( (unsigned)buffer.size() > buffer_max ){
+		uncharge( buffer.first().cache );
 		buffer.removeFirst();
+	}
 }
 
 void fileManager::loading_handler(){
 	if( current_file == -1 )
 		return;
 	
+	//Load further ahead in the direction the user is moving
 	int loading_length = settings.value( "loading/length", 2 ).toInt();
-	for( int i=0; i<=loading_length; i++ ){
-		int next = move( i );
-		if( has_file(next) && !files[next].cache ){
-			load_image( next );
-			break;
+	auto window = planner.plan( loading_length );
+	
+	// Unload everything outside the window
+	int last = move( window.forward+1 );
+	int first = move( -window.backward-1 );
+	if( !wrap || window.forward + window.backward + 1 < files.size() ){ //With wrap, a large window covers everything
+		if( last > first ){
+			for( int i=last; i<files.size(); i++ )
+				unload_image( i );
+			for( int i=first; i>=0; i-- )
+				unload_image( i );
 		}
+		else
+			for( int i=last; i<=first; i++ )
+				unload_image( i );
+	}
+	
+	//Queue everything within the window, prioritized by the distance to the current file.
+	//Files behind the direction of travel get a lower priority.
+	load_image( current_file, 0 );
+	int forward_weight  = window.forward < window.backward ? 2 : 1;
+	int backward_weight = window.backward < window.forward ? 2 : 1;
+	for( int i=1; i<=std::max( window.forward, window.backward ); i++ ){
+		int next = move( i );
+		if( i <= window.forward && has_file(next) && admit(next) )
+			load_image( next, i * forward_weight );
 		
 		int prev = move( -i );
-		if( has_file(prev) && !files[prev].cache ){
-			load_image( prev );
-			break;
-		}
+		if( i <= window.backward && has_file(prev) && admit(prev) )
+			load_image( prev, i * backward_weight );
 	}
 	
-	// Unload everything after loading length
-	int last = move( loading_length+1 );
-	int first = move( -loading_length-1 );
-	if( last > first ){
-		for( int i=last; i<files.size(); i++ )
-			unload_image( i );
-		for( int i=first; i>=0; i-- )
-			unload_image( i );
-	}
+	enforce_budget();
+}
+
+
+/** Tell the planner about a move to 'index', and whether it was loaded in time */
+void fileManager::record_navigation( int index ){
+	if( current_file == -1 )
+		return;
+	
+	int offset = index - current_file;
+	if( wrap && std::abs( offset ) > files.size() / 2 )
+		offset += offset > 0 ? -files.size() : files.size(); //Wrapped around
+	planner.navigated( offset );
+	
+	auto& cache = files[index].cache;
+	if( cache && cache->get_status() == imageCache::LOADED )
+		planner.arrived( prefetchPlanner::HIT );
+	else if( cache )
+		planner.arrived( prefetchPlanner::PARTIAL );
+	else if( std::find( buffer.begin(), buffer.end(), files[index] ) != buffer.end() )
+		planner.arrived( prefetchPlanner::HIT );
 	else
-		for( int i=last; i<=first; i++ )
-			unload_image( i );
+		planner.arrived( prefetchPlanner::MISS );
+}
+
+/** Count the memory of 'cache' against the budget, until uncharge() is called.
+ *  The amount follows the image while it is being loaded. */
+void fileManager::charge( QString name, const std::shared_ptr<imageCache>& cache ){
+	if( !cache || charges.contains( cache.get() ) )
+		return;
+	charges[cache.get()] = { name, 0 };
+	recharge( cache.get() );
+	
+	//Emitted from the loading threads, so these are queued. It might be uncharged by then,
+	//so 'image' is only dereferenced if it is still in 'charges'
+	auto image = cache.get();
+	connect( image, &imageCache::info_loaded,  this, [=](){ recharge( image ); } );
+	connect( image, &imageCache::frame_loaded, this, [=](){ recharge( image ); } );
+	connect( image, &imageCache::frame_prepared, this, [=](){ recharge( image ); } );
+}
+
+/** Update the amount counted for 'cache', if it is charged */
+void fileManager::recharge( imageCache* cache ){
+	auto it = charges.find( cache );
+	if( it == charges.end() )
+		return;
+	auto bytes = memory_of( *cache );
+	memory_total += bytes - it->bytes;
+	it->bytes = bytes;
+}
+
+void fileManager::uncharge( const std::shared_ptr<imageCache>& cache ){
+	auto it = charges.find( cache.get() );
+	if( it == charges.end() )
+		return;
+	memory_total -= it->bytes;
+	charges.erase( it );
+}
+
+/** @return Bytes 'cache' uses, or will use once it is loaded */
+qint64 fileManager::memory_of( const imageCache& cache ) const{
+	auto used = cache.get_memory_size();
+	auto status = cache.get_status();
+	if( cache.loaded() > 0 || status == imageCache::LOADED || status == imageCache::INVALID )
+		return used;
+	
+	//Not decoded yet, so estimate it from the dimensions the loader read from the header
+	auto size = cache.get_size_hint();
+	return std::max( used, qint64( size.width() ) * size.height() * 4 );
+}
+
+/** @return The amount of files between 'index' and the current file */
+int fileManager::distance( int index ) const{
+	if( index < 0 )
+		return files.size(); //Not in the folder anymore
+	int offset = std::abs( index - current_file );
+	return wrap ? std::min( offset, files.size() - offset ) : offset;
+}
+
+/** Check if there is room for preloading a file.
+ *  Its size is not known until the loader have read it, so enforce_budget()
+ *  unloads the least valuable files when it turns out to be too large. */
+bool fileManager::admit( int index ){
+	if( memory_budget <= 0 || files[index].cache )
+		return true;
+	return memory_total < memory_budget;
+}
+
+void fileManager::image_loaded( imageCache* image ){
+	//It was queued before the monitor changed. Only charged images are sure to still exist
+	if( charges.contains( image ) && is_stale( *image ) ){
+		reload_stale();
+		return;
+	}
+	
+	recharge( image );
+	enforce_budget();
+}
+
+/** Unload the least valuable images until everything fits in 'memory_budget'.
+ *  Images which were recently wanted and are close to the current file are kept. */
+void fileManager::enforce_budget(){
+	if( memory_budget <= 0 )
+		return;
+	
+	auto cost = [&]( const File& file, int index ){
+			auto age = use_counter - file.last_used;
+			return double( age + 1 ) * ( distance( index ) + 1 );
+		};
+	
+	while( memory_total > memory_budget ){
+		//Find the worst candidate among the cached images, buffered ones before preloaded ones at equal cost
+		double worst_cost = -1;
+		bool worst_buffered = false;
+		auto worst_buffer = buffer.end();
+		int worst_file = -1;
+		for( auto it = charges.begin(); it != charges.end(); ++it ){
+			int index = index_of( { it->name, collator } );
+			bool preloaded = index != -1 && files[index].cache.get() == it.key();
+			if( preloaded && index == current_file )
+				continue;
+			
+			auto buffered = buffer.end();
+			if( !preloaded ){
+				buffered = std::find_if( buffer.begin(), buffer.end()
+					,	[&]( const File& file ){ return file.cache.get() == it.key(); }
+					);
+				if( buffered == buffer.end() )
+					continue; //The full resolution version of the current file
+			}
+			
+			auto current = cost( preloaded ? files[index] : *buffered, index );
+			if( current > worst_cost || ( current == worst_cost && !preloaded && !worst_buffered ) ){
+				worst_cost = current;
+				worst_buffered = !preloaded;
+				worst_file = preloaded ? index : -1;
+				worst_buffer = buffered;
+			}
+		}
+		
+		if( worst_file != -1 ){
+			loader.cancel( files[worst_file].cache.get() );
+			uncharge( files[worst_file].cache );
+			files[worst_file].cache = {};
+		}
+		else if( worst_buffer != buffer.end() ){
+			uncharge( worst_buffer->cache );
+			buffer.erase( worst_buffer );
+		}
+		else
+			break; //Only the current image is left
+	}
 }
 
 
 void fileManager::clear_cache(){
-	if( watcher.directories().size() > 0 )
-		watcher.removePaths( watcher.directories() );
+	cancel_scan();
+	watcher.clear();
 	dir = "";
+	cancel_full_resolution();
+	for( auto& file : files )
+		if( file.cache )
+			loader.cancel( file.cache.get() );
+	
 	if( current_file != -1 ){
 		current_file = -1;
 		emit file_changed();
@@ -233,6 +603,123 @@ void fileManager::clear_cache(){
 	//Delete any images in the buffer and cache
 	files.clear();
 	buffer.clear();
+	charges.clear();
+	memory_total = 0;
+}
+
+/** Reload the current file at its original resolution, if it was decoded at a reduced one */
+void fileManager::load_full_resolution(){
+	if( !has_file() || !files[current_file].cache || !files[current_file].cache->is_scaled() )
+		return;
+	if( full_cache && full_name == files[current_file].name )
+		return; //Already loading
+	
+	cancel_full_resolution();
+	full_name = files[current_file].name;
+	full_cache = loader.load_image( file( current_file ), -1, true );
+	charge( full_name, full_cache );
+}
+
+void fileManager::cancel_full_resolution(){
+	if( full_cache )
+		loader.cancel( full_cache.get() );
+	uncharge( full_cache );
+	full_cache = {};
+	full_name = "";
+}
+
+void fileManager::full_resolution_loaded( imageCache* image ){
+	if( !full_cache || full_cache.get() != image )
+		return;
+	
+	auto cache = std::move( full_cache );
+	int index = index_of( { full_name, collator } );
+	cancel_full_resolution();
+	
+	//Replace the reduced version, unless it have been unloaded in the meantime
+	if( cache->get_status() != imageCache::LOADED || index == -1 || !files[index].cache )
+		return;
+	uncharge( files[index].cache );
+	files[index].cache = std::move( cache );
+	charge( files[index].name, files[index].cache );
+	if( index == current_file )
+		emit file_changed();
+}
+
+/** Prepare images and previews for being shown on 'monitor' */
+void fileManager::set_monitor( int monitor ){
+	this->monitor = monitor;
+	loader.set_monitor( monitor, prepare_frames );
+	reload_stale();
+}
+
+/** @return true if 'cache' was prepared for another profile than the one of 'monitor' */
+bool fileManager::is_stale( const imageCache& cache ) const{
+	auto profile = cache.get_prepared_profile();
+	return !profile.isEmpty() && profile != imageCache::get_manager()->output_id( monitor );
+}
+
+/** Prepared images can't be converted again, so load the ones for another profile again */
+void fileManager::reload_stale(){
+	bool changed = false;
+	for( auto& file : files )
+		if( file.cache && is_stale( *file.cache ) ){
+			uncharge( file.cache );
+			file.cache = {};
+			changed = true;
+		}
+	for( auto it = buffer.begin(); it != buffer.end(); ){
+		if( is_stale( *it->cache ) ){
+			uncharge( it->cache );
+			it = buffer.erase( it );
+		}
+		else
+			++it;
+	}
+	if( full_cache && is_stale( *full_cache ) )
+		cancel_full_resolution();
+	
+	if( changed )
+		loading_handler();
+}
+
+/** Save a screen sized version of a large image, so it can be shown at once next time */
+void fileManager::store_preview( imageCache* image ){
+	if( !previews->enabled() || preview_size.isEmpty() )
+		return;
+	
+	auto it = std::find_if( files.begin(), files.end(), [=]( const File& file ){ return file.cache.get() == image; } );
+	if( it == files.end() )
+		return;
+	auto cache = it->cache;
+	if( cache->get_status() != imageCache::LOADED || cache->is_animated() || cache->frame_count() != 1 )
+		return;
+	
+	//Small images are decoded about as fast as the preview is read
+	auto original = cache->is_scaled() ? cache->original_size() : cache->frame_size( 0 );
+	auto bounds = cache->get_orientation().finalSize( preview_size );
+	if( original.width() <= bounds.width() && original.height() <= bounds.height() )
+		return;
+	
+	//Converted for the monitor it is shown on, and found by the loader with its profile
+	auto path = file( it - files.begin() );
+	auto cached = previews;
+	auto target = monitor;
+	QtConcurrent::run( [=](){
+			auto manager = cache->get_manager();
+			auto profile = manager->output_id( target );
+			if( cached->contains( path, profile ) )
+				return;
+			
+			//The loader might already have converted it
+			auto prepared = cache->get_prepared_profile();
+			if( !prepared.isEmpty() && prepared != profile )
+				return;
+			auto preview = cache->frame( 0 ).scaled( bounds, Qt::KeepAspectRatio, Qt::SmoothTransformation );
+			if( prepared.isEmpty() )
+				manager->doTransform( preview, cache->get_profile(), target );
+			cached->store( path, profile, { preview, original, cache->get_orientation() } );
+		} );
 }
 
 /** @return The index of <file> or -1 if not found */
@@ -249,70 +736,118 @@ int fileManager::find_file( File file ) const{
 	return it != files.end() ? it - files.begin() : files.size()-1;
 }
 
-static QMutex mutex; //TODO: This should be part of fileManager
+/** List the whole directory again, for when the watcher can't tell what changed */
 void fileManager::dir_modified(){
-	//Make absolutely sure this is not called again before it finish loading
-	disconnect( &watcher, SIGNAL( directoryChanged( QString ) ), this, SLOT( dir_modified() ) );
-	QMutexLocker locker(&mutex);
-	
-	//Wait shortly to ensure files have been updated
-	//Solution by kshark27: http://stackoverflow.com/a/11487434/2248153
-	QTime wait = QTime::currentTime().addMSecs( 200 );
-	while( QTime::currentTime() < wait )
-		QCoreApplication::processEvents( QEventLoop::AllEvents, 100 );
-	
-	connect( &watcher, SIGNAL( directoryChanged( QString ) ), this, SLOT( dir_modified() ) );
-	
-	//processEvents can modify this object, so check this afterwards
 	if( !has_file() )
 		return;
 	
-	//Save imageCache's which might still be valid
-	QList<File> old;
-	for( auto& file : files )
-		if( file.cache )
-			old << std::move( file ); //NOTE: Expects load_files to clear files
+	//The listing in progress might have missed the change, check again once it is done
+	if( scanning ){
+		scan_outdated = true;
+		return;
+	}
 	
-	//Keep the name of the old file, for restoring position
+	//List it again in the background, scan_finished() keeps what is already loaded
+	start_scan();
+	emit position_changed();
+}
+
+/** Apply the changes reported by the watcher, without listing the directory again */
+void fileManager::files_changed( QStringList added, QStringList removed ){
+	if( !has_file() )
+		return;
+	if( scanning ){
+		scan_outdated = true;
+		return;
+	}
 	File old_file = files[current_file];
 	
-	//Prepare the QLists
-	current_file = -1; //TODO: we need this to avoid clear_cache() to notify the viewer. FIX
-	load_files( dir );
-	
-	//Restore old elements
-	for( auto& elem : old ){
-		int new_index = index_of( elem );
-		if( new_index != -1 )
-			files[new_index] = std::move( elem );
+	//Convert to the names used in 'files'
+	auto to_name = [&]( QString path ){
+			if( recursive )
+				return path;
+			QFileInfo info( path );
+			return info.absolutePath() == dir ? info.fileName() : QString();
+		};
+	
+	for( auto path : removed ){
+		auto name = to_name( path );
+		if( name.isEmpty() )
+			continue;
+		
+		int index = index_of( { name, collator } );
+		if( index != -1 )
+			remove_file( index );
+		else if( recursive ){
+			//Might be a directory, remove everything in it
+			for( int i=files.size()-1; i>=0; i-- )
+				if( files[i].name.startsWith( name + "/" ) )
+					remove_file( i );
+		}
 	}
-	old.clear();
 	
-	if( files.size() == 0 ){
-		if( settings.value( "loading/quit-on-empty", false ).toBool() )
-			QCoreApplication::quit();
-		current_file = -1;
-		emit file_changed();
-		return; //TODO: can't do this!
+	bool include_hidden = show_hidden || force_hidden;
+	for( auto path : added ){
+		auto name = to_name( path );
+		if( name.isEmpty() || !supports_extension( name ) || ( !include_hidden && QFileInfo( path ).isHidden() ) )
+			continue;
+		
+		File file( name, collator );
+		int index = index_of( file );
+		if( index != -1 ){
+			//Overwritten, so the cached version is outdated
+			if( files[index].cache )
+				loader.cancel( files[index].cache.get() );
+			uncharge( files[index].cache );
+			files[index].cache = {};
+			remove_buffered( file );
+		}
+		else
+			files.insert( std::lower_bound( files.begin(), files.end(), file ), file );
 	}
 	
-	//Set image position to the previous position, or nearest if deleted
+	if( check_empty() )
+		return;
+	
+	//Stay on the same file, or the nearest one if it was deleted
 	current_file = find_file( old_file );
 	emit position_changed();
-	
-	if( files[current_file] != old_file )
+	if( files[current_file] != old_file || !files[current_file].cache )
 		emit file_changed();
-		
-	//Start loading the new files
-	if( !files[ current_file ].cache ){
-		emit file_changed();
-		load_image( current_file );
-	}
 	loading_handler();
 }
 
+void fileManager::remove_file( int index ){
+	if( files[index].cache )
+		loader.cancel( files[index].cache.get() );
+	uncharge( files[index].cache );
+	remove_buffered( files[index] );
+	files.removeAt( index );
+}
+
+void fileManager::remove_buffered( const File& file ){
+	auto it = std::find( buffer.begin(), buffer.end(), file );
+	if( it == buffer.end() )
+		return;
+	uncharge( it->cache );
+	buffer.erase( it );
+}
+
+/** Handle the directory becoming empty
+ *  @return true if it is empty */
+bool fileManager::check_empty(){
+	if( files.size() > 0 )
+		return false;
+	
+	if( settings.value( "loading/quit-on-empty", false ).toBool() )
+		QCoreApplication::quit();
+	current_file = -1;
+	emit file_changed();
+	return true;
+}
+
 void fileManager::delete_current_file(){
-	//QFileWatcher will ensure that the list will be updated
+	//DirectoryWatcher will ensure that the list will be updated
 	QFile::remove( file_path() );
 }
 
@@ -330,8 +865,8 @@ QString fileManager::file_name() const{
 	//TODO: once we have a meta-data system, check if it contains a title
 	return QString( "%1 - [%2/%3]" )
 		.arg( name )
-		.arg( QString::number( current_file+1 ) )
-		.arg( QString::number( files.size() ) )
+		.arg( scanning ? "?" : QString::number( current_file+1 ) )
+		.arg( scanning ? "?" : QString::number( files.size() ) )
 		;
 }
 
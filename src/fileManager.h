@@ -22,15 +22,18 @@
 #include <QString>
 #include <QStringList>
 #include <QFileInfoList>
-#include <QFileSystemWatcher>
 #include <QSettings>
 #include <QLinkedList>
 #include <QCollator>
+#include <QFutureWatcher>
 
 #include <memory>
 
 #include "imageLoader.h"
+#include "prefetchPlanner.h"
+#include "previewCache.h"
 #include "FileSystem/ExtensionChecker.hpp"
+#include "FileSystem/DirectoryWatcher.hpp"
 
 
 class imageCache;
@@ -40,9 +43,14 @@ class fileManager : public QObject{
 	
 	private:
 		const QSettings& settings;
-		QFileSystemWatcher watcher;
+		DirectoryWatcher watcher;
 		ExtensionChecker have_ext;
+		std::shared_ptr<previewCache> previews;	//Shared with the threads saving previews
+		QSize preview_size;
+		bool prepare_frames;
+		int monitor{ 0 };	//Monitor the images are shown on
 		imageLoader loader;
+		prefetchPlanner planner;
 		
 		bool show_hidden;
 		bool force_hidden;
@@ -55,6 +63,7 @@ class fileManager : public QObject{
 			QString name; //relative file path
 			QCollatorSortKey key;
 			std::shared_ptr<imageCache> cache;
+			unsigned long last_used{ 0 };	//Value of 'use_counter' when it was last wanted
 			
 			File( QString name, const QCollator& c ) : name(name), key(c.sortKey( name )) { }
 			//TODO: on win8.1 in release mode, if name are equals, key::compare returns a random value
@@ -66,27 +75,83 @@ class fileManager : public QObject{
 		QList<File> files;
 		int current_file;  //Index to currently used file
 		
+		//Listing of the directory in the background, 'files' only contains the current file meanwhile
+		struct ScanResult{
+			unsigned generation;
+			QList<File> files;
+			QHash<int, QString> watches;	//Sub-directories watched by the scan, see DirectoryWatcher
+		};
+		QFutureWatcher<ScanResult> scan_watcher;
+		bool scan_pending{ false };	//'scan_watcher' have a result which is not handled yet
+		QList<QFutureWatcher<ScanResult>*> retired_scans;	//Replaced scans, which still hold watches
+		CancelToken scan_cancel;
+		unsigned scan_generation{ 0 };	//Increased when a scan gets outdated
+		bool scanning{ false };
+		bool scan_outdated{ false };	//The directory changed while scanning
+		void start_scan();
+		void cancel_scan();
+		static QList<File> enumerate_files( QDir dir, QDir::Filters filters, bool recursive
+			,	const ExtensionChecker& checker, const QCollator& collator, const CancelToken& cancel
+			,	QStringList& directories );
+		static QList<File> enumerate_indexed( QDir dir, QDir::Filters filters
+			,	const ExtensionChecker& checker, const QCollator& collator, const CancelToken& cancel
+			,	QStringList& directories );
+		
 		unsigned buffer_max;
 		QLinkedList<File> buffer;
 		void unload_image( int index );
 		
+		//Limit the memory of all cached images, 0 for no limit
+		qint64 memory_budget;
+		unsigned long use_counter{ 0 };
+		struct Charge{
+			QString name;	//File it is cached for
+			qint64 bytes;
+		};
+		QHash<imageCache*, Charge> charges;	//Every cached image and the bytes counted for it
+		qint64 memory_total{ 0 };	//Sum of 'charges'
+		void charge( QString name, const std::shared_ptr<imageCache>& cache );
+		void recharge( imageCache* cache );
+		void uncharge( const std::shared_ptr<imageCache>& cache );
+		qint64 memory_of( const imageCache& cache ) const;
+		int distance( int index ) const;
+		bool admit( int index );
+		void enforce_budget();
+		void remove_buffered( const File& file );
+		
+		//Full resolution version of a file which was decoded at a reduced size
+		std::shared_ptr<imageCache> full_cache;
+		QString full_name;
+		void cancel_full_resolution();
+		
+		bool is_stale( const imageCache& cache ) const;
+		void reload_stale();
+		
 		//Accessors to 'files'
 		QString prefix() const{ return recursive ? "" : dir + "/"; }
 		QString file( int index ) const{ return prefix() + files[index].name; }
+		QString name_of( QFileInfo file ) const;
 		int index_of( File file ) const;
 		
-		void load_image( int pos );
+		void load_image( int pos, int priority=0 );
+		void remove_file( int index );
+		bool check_empty();
+		void record_navigation( int index );
 		
-		void load_files( QDir dir );
 		void clear_cache();
 		
 		int find_file( File file ) const;
 		
 	public:
 		explicit fileManager( const QSettings& settings );
-		virtual ~fileManager(){ clear_cache(); }
+		virtual ~fileManager();
 		
 		void set_show_hidden_files( bool value ){ show_hidden = value; }
+		void set_target_size( QSize size ){
+			loader.set_target_size( size );
+			preview_size = size;
+		}
+		void set_monitor( int monitor );
 		
 		void set_files( QString file ){ set_files( QFileInfo( file ) ); }
 		void set_files( QFileInfo file );
@@ -110,10 +175,20 @@ class fileManager : public QObject{
 		QString file_name() const;
 		QString file_path() const{ return has_file() ? file( current_file ) : ""; }
 		
+		const prefetchPlanner::Statistics& prefetch_statistics() const{ return planner.statistics(); }
+		
+		
+	public slots:
+		void load_full_resolution();
 		
 	private slots:
 		void loading_handler();
 		void dir_modified();
+		void files_changed( QStringList added, QStringList removed );
+		void scan_finished();
+		void full_resolution_loaded( imageCache* image );
+		void store_preview( imageCache* image );
+		void image_loaded( imageCache* image );
 		
 	signals:
 		void file_changed();
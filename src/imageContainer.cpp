@@ -38,6 +38,8 @@
 #include <QKeyEvent>
 #include <QMenu>
 #include <QStandardPaths>
+#include <QApplication>
+#include <QDesktopWidget>
 
 
 imageContainer::AnimButton::AnimButton( imageContainer* parent )
@@ -57,6 +59,16 @@ void imageContainer::AnimButton::setState( bool is_playing ){
 }
 
 
+void imageContainer::screen_changed( int monitor ){
+	//Images never need more pixels than the screen when fitted to the window
+	if( settings.value( "loading/reduced-resolution", true ).toBool() ){
+		auto size = QApplication::desktop()->screenGeometry( monitor ).size();
+		files->set_target_size( size * devicePixelRatioF() ); //In physical pixels on HiDPI screens
+	}
+	
+	files->set_monitor( monitor );
+}
+
 void imageContainer::dragEnterEvent( QDragEnterEvent *event ){
 	QList<QUrl> urls = event->mimeData()->urls();
 	
@@ -98,6 +110,10 @@ imageContainer::imageContainer( QWidget* parent ) : QWidget( parent )
 	files = std::make_unique<fileManager>( settings );
 	manager = std::make_unique<windowManager>( *this );
 	ui->setupUi( this );
+	
+	//Let the loader prepare images for the monitor the window is on
+	screen_changed( QApplication::desktop()->screenNumber( this ) );
+	connect( viewer, &imageViewer::monitor_changed, this, [this]( int monitor ){ screen_changed( monitor ); } );
 
 	//Add and refresh widgets
 	create_menubar();
@@ -112,6 +128,7 @@ imageContainer::imageContainer( QWidget* parent ) : QWidget( parent )
 	connect( viewer, SIGNAL( image_changed() ),   this, SLOT( updateImageInfo() ) );
 	connect( viewer, SIGNAL( double_clicked() ),  this, SLOT( toogle_fullscreen() ) );
 	connect( viewer, SIGNAL( resize_wanted() ),  this, SLOT( resize_window() ) );
+	connect( viewer, SIGNAL( full_resolution_wanted() ), files.get(), SLOT( load_full_resolution() ) );
 	connect( viewer, SIGNAL( rocker_left() ),     this, SLOT( prev_file() ) );
 	connect( viewer, SIGNAL( rocker_right() ),    this, SLOT( next_file() ) );
 	connect( viewer, SIGNAL( context_menu(QContextMenuEvent) )
@@ -70,6 +70,7 @@ class imageContainer: public QWidget{
 		
 		void create_menubar();
 		void create_context();
+		void screen_changed( int monitor );
 		
 	protected:
 		virtual void keyPressEvent( QKeyEvent *event );
@@ -18,49 +18,139 @@
 #include "imageLoader.h"
 
 #include "viewer/imageCache.h"
+#include "previewCache.h"
 #include <QMutexLocker>
 #include <QFileInfo>
+#include <algorithm>
 
 #include "ImageReader/ImageReader.hpp"
 
-void imageLoader::run(){
-	mutex.lock();
-	while( image ){
-		//Load data
-		QString filepath = file;
-		auto loading = std::move( image );
-		
-		mutex.unlock();
-		emit image_fetched();
-		
-		ImageReader reader; //TODO: initialize in constructor?
-		reader.read( *loading, filepath );
-		emit image_loaded( loading.get() );
-		
-		mutex.lock();	//Make sure to lock it again, as wee need it at the while loop check
+imageLoader::imageLoader( int thread_count, previewCache* previews ) : previews( previews ){
+	if( thread_count <= 0 )
+		thread_count = std::max( QThread::idealThreadCount(), 1 );
+	
+	for( int i=0; i<thread_count; i++ ){
+		workers.push_back( std::make_unique<Worker>( *this ) );
+		workers.back()->start();
 	}
-	mutex.unlock(); //Make sure to lock it when the while loop exits
 }
 
-/* Attempts to start loading an image. Returns true on success, false on failure. */
-std::shared_ptr<imageCache> imageLoader::load_image( QString filepath ){
-	mutex.lock();
-	if( image ){
-		//An image is already in the queue, can't add this one
-		mutex.unlock();
-		return {};
+imageLoader::~imageLoader(){
+	{
+		QMutexLocker locker( &mutex );
+		stopping = true;
+		queue.clear();
+		for( auto& job : active )
+			job.cancel.cancel();
 	}
+	wake.wakeAll();
 	
-	image = std::make_shared<imageCache>();
-	file = filepath;
+	for( auto& worker : workers )
+		worker->wait();
+}
+
+/* Waits for a job, returns false when the loader is shutting down */
+bool imageLoader::take_job( Job& job ){
+	QMutexLocker locker( &mutex );
+	while( queue.empty() && !stopping )
+		wake.wait( &mutex );
 	
-	mutex.unlock();
+	if( stopping )
+		return false;
 	
-	if( !isRunning() )
-		start();
+	//Take the one with the lowest priority value, ties are resolved in FIFO order
+	auto it = std::min_element( queue.begin(), queue.end()
+		,	[]( const Job& a, const Job& b ){ return a.priority < b.priority; }
+		);
+	job = std::move( *it );
+	queue.erase( it );
+	active.push_back( job );
+	return true;
+}
+
+void imageLoader::finish_job( const Job& job ){
+	QMutexLocker locker( &mutex );
+	auto it = std::find_if( active.begin(), active.end()
+		,	[&]( const Job& other ){ return other.image == job.image; }
+		);
+	if( it != active.end() )
+		active.erase( it );
+}
+
+void imageLoader::work(){
+	ImageReader reader;
+	
+	Job job;
+	while( take_job( job ) ){
+		if( previews ){
+			auto preview = previews->find( job.file, job.image->get_manager()->output_id( job.monitor ) );
+			if( !preview.image.isNull() ){
+				job.image->set_orientation( preview.orientation );
+				job.image->set_size_hint( preview.original );
+				job.image->set_thumbnail( preview.image );
+			}
+		}
+		
+		auto err = reader.read( *job.image, job.file, job.cancel, job.target );
+		if( job.prepare ){
+			if( err == AReader::ERROR_NONE && !job.cancel.isCancelled() )
+				job.image->prepare( job.monitor );
+			job.image->finish_prepare();
+		}
+		finish_job( job );
+		if( err != AReader::ERROR_CANCELLED )
+			emit image_loaded( job.image.get() );
+		job = {};
+	}
+}
+
+/* Queue an image for loading. Returns the imageCache which will contain the image. */
+std::shared_ptr<imageCache> imageLoader::load_image( QString filepath, int priority, bool full_size ){
+	auto image = std::make_shared<imageCache>();
+	
+	{
+		QMutexLocker locker( &mutex );
+		if( prepare )
+			image->expect_prepare();
+		queue.push_back( { image, filepath, priority, full_size ? QSize() : target_size, monitor, prepare } );
+	}
+	wake.wakeOne();
 	
 	return image;
 }
 
+/* Images loaded afterwards may be decoded at a resolution just covering 'size' */
+void imageLoader::set_target_size( QSize size ){
+	QMutexLocker locker( &mutex );
+	target_size = size;
+}
 
+/* Images loaded afterwards are shown on 'monitor', and converted for it if 'prepare' is set */
+void imageLoader::set_monitor( int monitor, bool prepare ){
+	QMutexLocker locker( &mutex );
+	this->monitor = monitor;
+	this->prepare = prepare;
+}
+
+/* Change the priority of an image still waiting in the queue */
+void imageLoader::set_priority( const imageCache* image, int priority ){
+	QMutexLocker locker( &mutex );
+	for( auto& job : queue )
+		if( job.image.get() == image )
+			job.priority = priority;
+}
 
+/* Stop loading an image, either by removing it from the queue or by aborting the reader */
+void imageLoader::cancel( const imageCache* image ){
+	QMutexLocker locker( &mutex );
+	auto matches = [=]( const Job& job ){ return job.image.get() == image; };
+	
+	for( auto& job : queue )
+		if( matches( job ) )
+			job.image->finish_prepare(); //Will not be prepared now
+	queue.erase( std::remove_if( queue.begin(), queue.end(), matches ), queue.end() );
+	
+	auto it = std::find_if( active.begin(), active.end(), matches );
+	if( it != active.end() )
+		it->cancel.cancel();
+}
\ No newline at end of file
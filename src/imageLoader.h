@@ -19,44 +19,100 @@
 #define IMAGELOADER_H
 
 /*
-	This class loads a imageCache in a separate thread.
-	It can only load one at a time but it can store a single imageCache
-	until it is ready to start loading it. The signal image_fetched()
-	is emitted when it is possible to store a new one.
-	The signal image_loaded() is emitted when it is done loading an
-	imageCache.
+	This class loads imageCache's using a pool of worker threads.
+	Requests are kept in a queue ordered by priority, where a lower value
+	is loaded first. fileManager uses the distance to the current file as
+	the priority, so the image being viewed is always decoded first and
+	the neighbours are decoded in parallel on the remaining threads.
 	
-	Use the function bool load_image( imageCache*, QString ) to attempt
-	to add an imageCache for loading, returns true on success, false on
-	failure.
+	Use load_image( QString, int ) to add a file for loading. It returns
+	the imageCache which will be filled, so it can be shown while loading.
 	
-	Use delete_image( imageCache* ) to delete imageCache* which have been
-	loaded with the same object safely.
+	Use set_priority( imageCache*, int ) to re-prioritize an image which is
+	still waiting in the queue, it does nothing if it is already loading.
+	
+	Use cancel( imageCache* ) when an image is no longer wanted. It is
+	removed from the queue, or the reader is told to stop if it is
+	currently being loaded.
+	
+	If a previewCache is given, a saved preview of a file is set as the
+	thumbnail before decoding it.
+	
+	Use set_monitor( int, bool ) to tell which monitor images are shown on.
+	Saved previews are looked up for its profile, and if 'prepare' is set
+	still images are converted to that profile after decoding, so the
+	viewer doesn't need to do it on the GUI thread.
+	
+	Use set_target_size( QSize ) to let the readers decode at a reduced
+	resolution, if the image would be downscaled for display anyway. Pass
+	full_size to load_image() to get the image at its original resolution.
+	
+	The signal image_loaded() is emitted from the worker thread when it is
+	done loading an imageCache.
 */
 
+#include <QObject>
 #include <QThread>
 #include <QMutex>
+#include <QWaitCondition>
+#include <QSize>
 #include <memory>
+#include <vector>
+
+#include "ImageReader/CancelToken.hpp"
 
 class imageCache;
+class previewCache;
 
-class imageLoader: public QThread{
+class imageLoader: public QObject{
 	Q_OBJECT
 	
 	private:
+		class Worker: public QThread{
+			private:
+				imageLoader& loader;
+			protected:
+				void run() override{ loader.work(); }
+			public:
+				explicit Worker( imageLoader& loader ) : loader(loader) { }
+		};
+		
+		struct Job{
+			std::shared_ptr<imageCache> image;
+			QString file;	//Path to file which shall be loaded
+			int priority;
+			QSize target;	//Size it will be displayed at, invalid for full resolution
+			int monitor;	//Monitor it will be displayed on
+			bool prepare;	//Convert it for 'monitor' after decoding
+			CancelToken cancel;
+		};
+		
 		QMutex mutex;
-		std::shared_ptr<imageCache> image;
-		QString file;	//Path to file which shall be loaded
-	
-	protected:
-		void run();
+		QWaitCondition wake;
+		std::vector<Job> queue;
+		std::vector<Job> active; //Jobs currently being loaded
+		std::vector<std::unique_ptr<Worker>> workers;
+		bool stopping{ false };
+		QSize target_size;
+		int monitor{ 0 };
+		bool prepare{ false };
+		previewCache* previews;
+		
+		bool take_job( Job& job );
+		void finish_job( const Job& job );
+		void work();
 	
 	public:
-		explicit imageLoader() { };
-		std::shared_ptr<imageCache> load_image( QString filepath );
+		explicit imageLoader( int thread_count=0, previewCache* previews=nullptr );
+		~imageLoader();
+		
+		std::shared_ptr<imageCache> load_image( QString filepath, int priority=0, bool full_size=false );
+		void set_target_size( QSize size );
+		void set_monitor( int monitor, bool prepare );
+		void set_priority( const imageCache* image, int priority );
+		void cancel( const imageCache* image );
 		
 	signals:
-		void image_fetched();
 		void image_loaded( imageCache *img );
 };
 
@@ -18,13 +18,35 @@
 #include <QApplication>
 #include <QUrl>
 #include <QIcon>
+#include <QFileInfo>
+#include <QSettings>
 
 #include "imageContainer.h"
+#include "singleInstance.h"
 
 
+/** Convert file:// urls to normal paths */
+static QString local_path( QString filepath ){
+	QUrl asUrl( filepath );
+	return asUrl.isLocalFile() ? asUrl.toLocalFile() : filepath;
+}
+
 int main( int argc, char *argv[] ){
+	//Let an already running viewer open it. This is done before creating
+	//QApplication, as avoiding all the initialization is the point of it.
+#ifdef PORTABLE
+	auto app_dir = QFileInfo( QString::fromLocal8Bit( argv[0] ) ).absolutePath();
+	QSettings settings( app_dir + "/settings.ini", QSettings::IniFormat );
+#else
+	QSettings settings( "spillerrec", "imgviewer" );
+#endif
+	bool single = settings.value( "single-instance", false ).toBool();
+	if( single && singleInstance::forward( argc == 2 ? local_path( QString::fromLocal8Bit( argv[1] ) ) : QString() ) )
+		return 0;
+	
 	QApplication a( argc, argv );
 	QStringList args = a.arguments();
+	QString filepath = args.size() == 2 ? local_path( args.at(1) ) : QString();
 	
 	imageContainer main(NULL);
 	main.setWindowIcon( QIcon( ":/main/appicon.png" ) );
@@ -35,16 +57,17 @@ int main( int argc, char *argv[] ){
 	main.init_win_toolbar();
 #endif
 	
-	if( args.size() == 2 ){
-		QString filepath = args.at(1);
-		
-		//Convert file:// urls to normal paths
-		QUrl asUrl( filepath );
-		if( asUrl.isLocalFile() )
-			filepath = asUrl.toLocalFile();
-		
+	if( !filepath.isEmpty() )
 		main.load_image( filepath );
-	}
+	
+	singleInstance instance;
+	if( single && instance.listen() )
+		QObject::connect( &instance, &singleInstance::file_requested, [&]( QString path ){
+				if( !path.isEmpty() )
+					main.load_image( path );
+				main.raise();
+				main.activateWindow();
+			} );
 	
 	return a.exec();
 }
@@ -25,6 +25,7 @@
 
 #include <QFile>
 #include <QByteArray>
+#include <algorithm>
 
 meta::meta( const uint8_t* file_data, unsigned length ){
 	data = exif_data_new_from_data( file_data, length );
@@ -72,12 +73,21 @@ unsigned char* meta::get_icc( unsigned &len ){
 QImage meta::get_thumbnail(){
 	if( data && data->data ){
 		imageCache image;
-		ReaderJpeg().read( image, data->data, data->size, "jpg" );
+		ReaderJpeg().read( image, data->data, data->size, "jpg", CancelToken(), QSize() );
 		if( image.frame_count() >= 1 )
 			return image.frame( 0 );
 	}
 	return {};
 }
 
+/** Thumbnail from EXIF data without the JPEG header, as in TIFF files and PNG eXIf chunks */
+QImage meta::get_tiff_thumbnail( const uint8_t* tiff, unsigned length ){
+	//libexif wants the "Exif\0\0" header, and reads at most 64 KiB like in a JPEG marker
+	static const char header[] = { 'E', 'x', 'i', 'f', 0, 0 };
+	QByteArray buffer( header, sizeof(header) );
+	buffer.append( reinterpret_cast<const char*>( tiff ), std::min( length, 0xFFF0u ) );
+	return meta( reinterpret_cast<const uint8_t*>( buffer.constData() ), buffer.size() ).get_thumbnail();
+}
+
 
 
@@ -33,6 +33,8 @@ class meta{
 		struct Orientation get_orientation();
 		uint8_t* get_icc( unsigned &len);
 		class QImage get_thumbnail();
+		
+		static class QImage get_tiff_thumbnail( const uint8_t* tiff, unsigned length );
 };
 
 
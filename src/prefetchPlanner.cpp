@@ -0,0 +1,94 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "prefetchPlanner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+static const qint64 history_length = 2000;	//Milliseconds of navigation to base the speed on
+static const int jump_length = 5;	//Moves longer than this are not counted as travel
+static const double lookahead_time = 1.5;	//Seconds of travel to load ahead
+
+void prefetchPlanner::forget_old(){
+	auto now = clock.elapsed();
+	while( !history.empty() && now - history.front().time > history_length )
+		history.pop_front();
+}
+
+void prefetchPlanner::navigated( int offset ){
+	if( offset == 0 )
+		return;
+	
+	if( std::abs( offset ) > jump_length )
+		history.clear();
+	else
+		history.push_back( { clock.elapsed(), offset } );
+	forget_old();
+}
+
+double prefetchPlanner::velocity(){
+	forget_old();
+	if( history.empty() )
+		return 0.0;
+	
+	int moved = 0;
+	for( auto& step : history )
+		moved += step.offset;
+	
+	//A single step gives a direction, but not much of a speed
+	auto span = std::max( clock.elapsed() - history.front().time, qint64(500) );
+	return moved * 1000.0 / span;
+}
+
+prefetchPlanner::Window prefetchPlanner::plan( int length ){
+	auto speed = velocity();
+	if( speed == 0.0 || length <= 0 )
+		return { length, length };
+	
+	//Cover the files the user will reach soon, at most four times the normal amount
+	int extra = std::min( int( std::ceil( std::abs( speed ) * lookahead_time ) ), length * 3 );
+	int ahead = length + extra;
+	int behind = std::max( length - extra, 1 );
+	
+	if( speed > 0 )
+		return { ahead, behind };
+	else
+		return { behind, ahead };
+}
+
+void prefetchPlanner::arrived( Arrival state ){
+	switch( state ){
+		case HIT:     stats.hits++;    break;
+		case PARTIAL: stats.partial++; break;
+		case MISS:    stats.misses++;  break;
+	}
+}
+
+QString prefetchPlanner::summary() const{
+	auto percent = [&]( unsigned amount ){
+			return QString::number( stats.total() ? amount * 100.0 / stats.total() : 0.0, 'f', 1 );
+		};
+	return QString( "Prefetching: %1 files, %2% hits, %3% still loading, %4% misses" )
+		.arg( stats.total() )
+		.arg( percent( stats.hits ) )
+		.arg( percent( stats.partial ) )
+		.arg( percent( stats.misses ) )
+		;
+}
@@ -0,0 +1,88 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PREFETCH_PLANNER_H
+#define PREFETCH_PLANNER_H
+
+/*
+	Decides how many files around the current one fileManager should load.
+	
+	Call navigated( int ) every time the user moves to another file, with
+	the amount of files moved. Steps from held keys and rocker gestures
+	simply arrive faster, so the speed covers them too. Long jumps, such as
+	going to the first file, clear the history as they say nothing about
+	where the user is going next.
+	
+	plan( int ) extends the window in the direction of travel the faster the
+	user moves, and shrinks it behind. Without recent movement it returns
+	the same amount in both directions.
+	
+	Call arrived( Arrival ) with the state of each file navigated to, to
+	collect statistics on how well the prefetching works.
+*/
+
+#include <QElapsedTimer>
+#include <QString>
+#include <deque>
+
+class prefetchPlanner{
+	public:
+		struct Window{
+			int forward;	//Files to load after the current one
+			int backward;	//Files to load before the current one
+		};
+		
+		enum Arrival{
+			HIT,	//Was already loaded
+			PARTIAL,	//Was still loading
+			MISS	//Was not queued at all
+		};
+		
+		struct Statistics{
+			unsigned hits{ 0 };
+			unsigned partial{ 0 };
+			unsigned misses{ 0 };
+			
+			unsigned total() const{ return hits + partial + misses; }
+		};
+		
+	private:
+		struct Step{
+			qint64 time;	//Milliseconds since 'clock' started
+			int offset;
+		};
+		QElapsedTimer clock;
+		std::deque<Step> history;
+		Statistics stats;
+		
+		void forget_old();
+		
+	public:
+		prefetchPlanner(){ clock.start(); }
+		
+		void navigated( int offset );
+		double velocity();	//Files per second, negative when moving backwards
+		Window plan( int length );
+		
+		void arrived( Arrival state );
+		const Statistics& statistics() const{ return stats; }
+		QString summary() const;
+};
+
+
+#endif
@@ -0,0 +1,163 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "previewCache.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+
+static const quint32 preview_magic = 0x49565056; //"IVPV"
+static const quint32 preview_version = 1;
+
+
+previewCache::previewCache( qint64 max_size )
+	:	dir( QStandardPaths::writableLocation( QStandardPaths::CacheLocation ) + "/previews" )
+	,	max_size( max_size )
+	{ }
+
+/** Name of the preview file, empty if 'path' can't be read */
+QString previewCache::key( QString path, QByteArray profile ) const{
+	QFileInfo info( path );
+	if( !info.exists() )
+		return "";
+	
+	QCryptographicHash hash( QCryptographicHash::Sha1 );
+	hash.addData( info.absoluteFilePath().toUtf8() );
+	hash.addData( QByteArray::number( info.size() ) );
+	hash.addData( QByteArray::number( info.lastModified().toMSecsSinceEpoch() ) );
+	hash.addData( profile );
+	return QString::fromLatin1( hash.result().toHex() ) + ".preview";
+}
+
+/** Find the previews saved in previous sessions, must be called with 'mutex' locked */
+void previewCache::index(){
+	if( indexed )
+		return;
+	indexed = true;
+	
+	QDir().mkpath( dir );
+	for( auto& info : QDir( dir ).entryInfoList( { "*.preview" }, QDir::Files ) ){
+		entries.insert( info.fileName(), { info.size(), info.lastModified().toMSecsSinceEpoch() } );
+		total_size += info.size();
+	}
+	evict();
+}
+
+/** Remove the least recently used previews until within the limit, must be called with 'mutex' locked */
+void previewCache::evict(){
+	while( total_size > max_size && !entries.isEmpty() ){
+		auto oldest = std::min_element( entries.begin(), entries.end()
+			,	[]( const Entry& a, const Entry& b ){ return a.last_used < b.last_used; }
+			);
+		QFile::remove( dir + "/" + oldest.key() );
+		total_size -= oldest->bytes;
+		entries.erase( oldest );
+	}
+}
+
+bool previewCache::contains( QString path, QByteArray profile ){
+	if( !enabled() )
+		return false;
+	
+	auto name = key( path, profile );
+	QMutexLocker locker( &mutex );
+	index();
+	return !name.isEmpty() && entries.contains( name );
+}
+
+previewCache::Preview previewCache::find( QString path, QByteArray profile ){
+	if( !enabled() )
+		return {};
+	
+	auto name = key( path, profile );
+	{	QMutexLocker locker( &mutex );
+		index();
+		auto it = entries.find( name );
+		if( name.isEmpty() || it == entries.end() )
+			return {};
+		it->last_used = QDateTime::currentMSecsSinceEpoch();
+	}
+	
+	QFile file( dir + "/" + name );
+	if( !file.open( QIODevice::ReadWrite ) )
+		return {};
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+	//Keep the order of use for the next session
+	file.setFileTime( QDateTime::currentDateTime(), QFileDevice::FileModificationTime );
+#endif
+	
+	QDataStream stream( &file );
+	Preview preview;
+	quint32 magic, version, format;
+	qint32 width, height;
+	qint8 rotation;
+	stream >> magic >> version >> preview.original;
+	stream >> rotation >> preview.orientation.flip_ver >> preview.orientation.flip_hor;
+	stream >> format >> width >> height;
+	if( magic != preview_magic || version != preview_version || stream.status() != QDataStream::Ok )
+		return {};
+	preview.orientation.rotation = rotation;
+	
+	//The pixels follow directly, and are read straight into the image
+	QImage image( width, height, QImage::Format( format ) );
+	if( image.isNull() )
+		return {};
+	auto bytes = image.byteCount();
+	if( stream.readRawData( reinterpret_cast<char*>( image.bits() ), bytes ) != bytes )
+		return {};
+	preview.image = image;
+	return preview;
+}
+
+void previewCache::store( QString path, QByteArray profile, const Preview& preview ){
+	auto name = key( path, profile );
+	auto& image = preview.image;
+	if( !enabled() || name.isEmpty() || image.isNull() )
+		return;
+	
+	QDir().mkpath( dir );
+	QSaveFile file( dir + "/" + name );
+	if( !file.open( QIODevice::WriteOnly ) )
+		return;
+	
+	QDataStream stream( &file );
+	auto& orientation = preview.orientation;
+	stream << preview_magic << preview_version << preview.original;
+	stream << qint8( orientation.rotation ) << orientation.flip_ver << orientation.flip_hor;
+	stream << quint32( image.format() ) << qint32( image.width() ) << qint32( image.height() );
+	stream.writeRawData( reinterpret_cast<const char*>( image.constBits() ), image.byteCount() );
+	if( !file.commit() )
+		return;
+	auto bytes = QFileInfo( dir + "/" + name ).size();
+	
+	QMutexLocker locker( &mutex );
+	index();
+	auto old = entries.find( name );
+	if( old != entries.end() )
+		total_size -= old->bytes;
+	entries.insert( name, { bytes, QDateTime::currentMSecsSinceEpoch() } );
+	total_size += bytes;
+	evict();
+}
@@ -0,0 +1,81 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PREVIEW_CACHE_H
+#define PREVIEW_CACHE_H
+
+/*
+	Keeps screen sized, color managed versions of viewed images on disk,
+	so large images can be shown right away the next time they are opened.
+	
+	Entries are keyed by the path, size and modification time of the file,
+	together with the ID of the profile the preview was converted to, so
+	any change to the file or the monitor gives a miss instead of a stale
+	preview. The previews are saved as raw pixels, which only needs a
+	single read to be shown.
+	
+	The total size on disk is kept below the limit given to the constructor
+	by removing the least recently used previews. Use it from any thread.
+*/
+
+#include "viewer/Orientation.hpp"
+
+#include <QByteArray>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QString>
+
+class previewCache{
+	public:
+		struct Preview{
+			QImage image;	//Before applying 'orientation'
+			QSize original;	//Size of the full image
+			Orientation orientation;
+		};
+		
+	private:
+		struct Entry{
+			qint64 bytes;
+			qint64 last_used;	//Milliseconds since epoch
+		};
+		
+		QString dir;
+		qint64 max_size;
+		QMutex mutex;
+		QHash<QString, Entry> entries;	//File name in 'dir'
+		qint64 total_size{ 0 };
+		bool indexed{ false };
+		
+		void index();
+		void evict();
+		QString key( QString path, QByteArray profile ) const;
+		
+	public:
+		explicit previewCache( qint64 max_size );
+		
+		bool enabled() const{ return max_size > 0; }
+		bool contains( QString path, QByteArray profile );
+		
+		/** @return The saved preview, with a null image if there is none */
+		Preview find( QString path, QByteArray profile );
+		void store( QString path, QByteArray profile, const Preview& preview );
+};
+
+
+#endif
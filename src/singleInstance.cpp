@@ -0,0 +1,94 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "singleInstance.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
+#include <QLocalSocket>
+
+static const int timeout = 1000; //ms
+
+
+singleInstance::singleInstance( QObject* parent ) : QObject( parent ){
+	connect( &server, SIGNAL( newConnection() ), this, SLOT( new_connection() ) );
+}
+
+QString singleInstance::name(){
+	//The socket might be visible to other users, so make it unique for this one
+	auto user = QCryptographicHash::hash( QDir::homePath().toUtf8(), QCryptographicHash::Md5 ).toHex().left( 16 );
+	return "imgviewer-" + QString::fromLatin1( user );
+}
+
+/** @return true if an instance accepts connections, even if it is too busy to reply */
+bool singleInstance::running(){
+	QLocalSocket socket;
+	socket.connectToServer( name() );
+	return socket.waitForConnected( timeout );
+}
+
+/** Send 'filepath' to a running instance
+ *  @return true if it was received */
+bool singleInstance::forward( QString filepath ){
+	QLocalSocket socket;
+	socket.connectToServer( name() );
+	if( !socket.waitForConnected( timeout ) )
+		return false;
+	
+	//The running instance might have another working directory
+	if( !filepath.isEmpty() )
+		filepath = QFileInfo( filepath ).absoluteFilePath();
+	socket.write( filepath.toUtf8() + '\n' );
+	if( !socket.waitForBytesWritten( timeout ) )
+		return false;
+	
+	//Wait for the reply, in case it stopped responding
+	return socket.waitForReadyRead( timeout ) && socket.read( 1 ) == "\n";
+}
+
+/** Receive the files sent by forward()
+ *  @return false if another instance is already listening */
+bool singleInstance::listen(){
+	if( server.listen( name() ) )
+		return true;
+	
+	//A crashed instance might have left the socket behind. Only take it over when
+	//nothing accepts connections, as a busy instance might just not have replied in time.
+	if( server.serverError() == QAbstractSocket::AddressInUseError && !running() ){
+		QLocalServer::removeServer( name() );
+		return server.listen( name() );
+	}
+	return false;
+}
+
+void singleInstance::new_connection(){
+	auto socket = server.nextPendingConnection();
+	if( !socket )
+		return;
+	
+	connect( socket, &QLocalSocket::readyRead, this, [=](){
+			while( socket->canReadLine() ){
+				auto line = socket->readLine();
+				line.chop( 1 ); //Remove '\n'
+				socket->write( "\n" );
+				emit file_requested( QString::fromUtf8( line ) );
+			}
+		} );
+	connect( socket, SIGNAL( disconnected() ), socket, SLOT( deleteLater() ) );
+}
@@ -0,0 +1,61 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SINGLE_INSTANCE_H
+#define SINGLE_INSTANCE_H
+
+/*
+	Lets an already running viewer open files, instead of starting a new
+	process which would have to initialize everything again.
+	
+	Call forward( QString ) first, it does not need a QApplication. It
+	returns true if a running instance accepted the file, in which case
+	this process can exit. Otherwise create a singleInstance and call
+	listen() to become the instance other processes forwards to, and
+	file_requested() will be emitted for each file they send. An empty path
+	means no file was given, but the window should still be shown.
+*/
+
+#include <QObject>
+#include <QString>
+#include <QLocalServer>
+
+class singleInstance: public QObject{
+	Q_OBJECT
+	
+	private:
+		QLocalServer server;
+		
+		static QString name();
+		static bool running();
+		
+	private slots:
+		void new_connection();
+		
+	public:
+		explicit singleInstance( QObject* parent=nullptr );
+		
+		static bool forward( QString filepath );
+		bool listen();
+		
+	signals:
+		void file_requested( QString filepath );
+};
+
+
+#endif
@@ -0,0 +1,36 @@
+/*
+	This file is part of imgviewer.
+
+	imgviewer is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	imgviewer is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with imgviewer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef FRAME_SOURCE_HPP
+#define FRAME_SOURCE_HPP
+
+#include <QImage>
+
+/** Decodes the frames of an animation on demand.
+ *  Used for animations which would use too much memory if all the frames
+ *  were kept, so imageCache only keeps the recently shown ones. */
+class AFrameSource{
+	public:
+		virtual ~AFrameSource(){ }
+		
+		/** @return The fully composed frame 'index', or a null image on failure */
+		virtual QImage frame( unsigned index ) = 0;
+};
+
+
+#endif
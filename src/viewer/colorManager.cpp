@@ -21,6 +21,8 @@
 #include <QApplication>
 #include <QtConcurrent>
 #include <QImage>
+#include <QMutexLocker>
+#include <algorithm>
 using namespace std;
 
 #include <qglobal.h>
@@ -98,7 +100,8 @@ using namespace std;
 #endif
 
 
-colorManager::colorManager(){
+static vector<ColorProfile> load_monitors(){
+	vector<ColorProfile> monitors;
 #ifdef Q_OS_WIN
 	//Try to grab it from the Windows APIs
 	DISPLAY_DEVICE disp;
@@ -129,27 +132,92 @@ colorManager::colorManager(){
 	//TODO:
 	#endif
 #endif
+	return monitors;
 }
 
-void colorManager::doTransform( QImage& img, const ColorProfile& in, unsigned monitor ) const{
+colorManager::colorManager() : monitors( load_monitors() ) {
+	//Profiles are per monitor, so a changed setup might use different profiles
+	auto changed = [this](){ refresh(); };
+	QObject::connect( qApp, &QGuiApplication::screenAdded, changed );
+	QObject::connect( qApp, &QGuiApplication::screenRemoved, changed );
+	QObject::connect( qApp, &QGuiApplication::primaryScreenChanged, changed );
+}
+
+void colorManager::refresh(){
+	auto loaded = load_monitors();
+	QMutexLocker locker( &mutex );
+	monitors = std::move( loaded );
+	transforms.clear();
+}
+
+/** Must be called with 'mutex' locked */
+const ColorProfile& colorManager::output( unsigned monitor ) const{
+	//Fallback to sRGB if there is no profile for the requested monitor
+	auto has_monitor_profile = monitor < monitors.size() && monitors[monitor];
+	return has_monitor_profile ? monitors[monitor] : p_srgb;
+}
+
+QByteArray colorManager::output_id( unsigned monitor ) const{
+	QMutexLocker locker( &mutex );
+	return output( monitor ).id();
+}
+
+/** @return A transform from 'in' to the profile of 'monitor', reusing earlier ones when possible */
+std::shared_ptr<ColorTransform> colorManager::transform( const ColorProfile& in, unsigned monitor
+	,	unsigned in_format, unsigned out_format, unsigned intent ) const{
 	//Fallback to sRGB if there is no input profile
 	auto& from = in ? in : p_srgb;
 	
-	//Fallback to sRGB if there is no profile for the requested monitor
-	auto has_monitor_profile = monitor < monitors.size() && monitors[monitor];
-	auto& output = has_monitor_profile ? monitors[monitor] : p_srgb;
+	QMutexLocker locker( &mutex );
+	auto& to = output( monitor );
+	auto key = from.id() + ":" + to.id() + ":" + QByteArray::number( in_format )
+		+ ":" + QByteArray::number( out_format ) + ":" + QByteArray::number( intent );
+	
+	auto it = transforms.find( key );
+	if( it != transforms.end() ){
+		stats.hits++;
+		it->second.last_used = ++uses;
+		return it->second.transform;
+	}
+	stats.misses++;
 	
-	//Create the transform
+	//Remove the least recently used one, if there are too many
+	const unsigned max_transforms = 32;
+	if( transforms.size() >= max_transforms ){
+		auto oldest = std::min_element( transforms.begin(), transforms.end()
+			,	[]( const std::pair<const QByteArray, CachedTransform>& a, const std::pair<const QByteArray, CachedTransform>& b )
+					{ return a.second.last_used < b.second.last_used; }
+			);
+		transforms.erase( oldest );
+	}
+	
+	auto created = std::make_shared<ColorTransform>( from.transformTo( to, in_format, out_format, intent ) );
+	transforms[key] = { created, ++uses };
+	return created;
+}
+
+colorManager::Statistics colorManager::statistics() const{
+	QMutexLocker locker( &mutex );
+	return stats;
+}
+
+QString colorManager::summary() const{
+	auto current = statistics();
+	return QString( "Color transforms: %1 reused, %2 created" ).arg( current.hits ).arg( current.misses );
+}
+
+void colorManager::doTransform( QImage& img, const ColorProfile& in, unsigned monitor ) const{
+	//Get the transform
 	//TODO: BRRA_8 is not gurantied!
 	//TODO: is perceptual intent what we want? Would there be any need to allow configuation here?
-	auto transform = from.transformTo( output, TYPE_BGRA_8, TYPE_BGRA_8, INTENT_PERCEPTUAL );
-	if( !transform )
+	auto converter = transform( in, monitor, TYPE_BGRA_8, TYPE_BGRA_8, INTENT_PERCEPTUAL );
+	if( !*converter )
 		return;
 		
 	//For indexed images, we only need to transform the color table
 	if( img.format() == QImage::Format_Indexed8 ){
 		auto colors = img.colorTable();
-		transform.execute( colors.data(), colors.data(), colors.size() );
+		converter->execute( colors.data(), colors.data(), colors.size() );
 		img.setColorTable( colors );
 		return;
 	}
@@ -163,7 +231,7 @@ void colorManager::doTransform( QImage& img, const ColorProfile& in, unsigned mo
 	for( int i=0; i < img.height(); i++ )
 		lines.push_back( static_cast<void*>(img.scanLine( i )) );
 	QtConcurrent::blockingMap( lines.begin(), lines.end()
-		,	[&]( void* line ){ transform.execute( line, line, img.width() ); }
+		,	[&]( void* line ){ converter->execute( line, line, img.width() ); }
 		);
 }
 
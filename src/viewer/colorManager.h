@@ -20,6 +20,9 @@
 
 #include <lcms2.h>
 #include <QString>
+#include <QByteArray>
+#include <QMutex>
+#include <map>
 #include <memory>
 #include <vector>
 
@@ -47,18 +50,28 @@ class ColorTransform{
 class ColorProfile{
 	private:
 		cmsHPROFILE profile{ nullptr };
-		ColorProfile( cmsHPROFILE profile ) : profile(profile) { }
+		QByteArray hash;
+		ColorProfile( cmsHPROFILE profile ) : profile(profile) {
+			if( profile ){
+				cmsUInt8Number md5[16];
+				cmsMD5computeID( profile );
+				cmsGetHeaderProfileID( profile, md5 );
+				hash = QByteArray( reinterpret_cast<const char*>( md5 ), sizeof(md5) ).toHex();
+			}
+		}
 		
 	public:
 		ColorProfile() { }
 		ColorProfile( const ColorProfile& copy ) = delete;
 		ColorProfile( ColorProfile&& other ){
 			profile = other.profile;
+			hash = other.hash;
 			other.profile = nullptr;
 		}
 		ColorProfile& operator=( ColorProfile&& other ){
 			cmsCloseProfile( profile );
 			profile = other.profile;
+			hash = other.hash;
 			other.profile = nullptr;
 			return *this;
 		}
@@ -74,21 +87,51 @@ class ColorProfile{
 		
 		static ColorProfile sRgb(){ return { cmsCreate_sRGBProfile() }; }
 		
+		/** @return MD5 of the profile as hex, empty if there is no profile */
+		QByteArray id() const{ return hash; }
+		
 		ColorTransform transformTo( const ColorProfile& to, unsigned in_format, unsigned out_format, unsigned intent, unsigned flags=0 ) const
 			{ return ColorTransform( cmsCreateTransform( profile, in_format, to.profile, out_format, intent, flags ) ); }
 };
 
 class colorManager{
 	public:
-		std::vector<ColorProfile> monitors;
+		struct Statistics{
+			unsigned hits{ 0 };
+			unsigned misses{ 0 };
+		};
 		
+	private:
+		std::vector<ColorProfile> monitors;
 		ColorProfile p_srgb{ ColorProfile::sRgb() };
 		
+		//Transforms are slow to create, so they are reused until the monitors change
+		struct CachedTransform{
+			std::shared_ptr<ColorTransform> transform;
+			unsigned long last_used;
+		};
+		mutable QMutex mutex;
+		mutable std::map<QByteArray, CachedTransform> transforms;
+		mutable unsigned long uses{ 0 };
+		mutable Statistics stats;
+		
+		const ColorProfile& output( unsigned monitor ) const;
+		std::shared_ptr<ColorTransform> transform( const ColorProfile& in, unsigned monitor
+			,	unsigned in_format, unsigned out_format, unsigned intent ) const;
 		
 	public:
 		colorManager();
 		
+		/** Load the monitor profiles again, after monitors have been changed */
+		void refresh();
+		
+		/** @return ColorProfile::id() of the profile images shown on 'monitor' are converted to */
+		QByteArray output_id( unsigned monitor ) const;
+		
 		void doTransform( class QImage& img, const ColorProfile& in, unsigned monitor ) const;
+		
+		Statistics statistics() const;
+		QString summary() const;
 };
 
 
@@ -24,20 +24,51 @@
 #include <QImageReader>
 #include <QPainter>
 #include <QTime>
+#include <QtConcurrent>
+#include <algorithm>
+#include <cstring>
 
 colorManager* imageCache::manager = nullptr;
+qint64 imageCache::memory_limit = qint64(1024) * 1024 * 1024;
 
 void imageCache::init(){
 	if( !manager )
 		manager = new colorManager();
 }
 
+imageCache::~imageCache(){
+	stop_decoder();
+}
+
+/** Wait for the background decoding to stop, must be called without 'frame_lock' */
+void imageCache::stop_decoder(){
+	stop_decoding = true;
+	decoder.waitForFinished();
+	stop_decoding = false;
+}
+
 void imageCache::reset(){
+	stop_decoder();
 	profile = {};
-	frames.clear();
+	size_hint = {};
+	full_size = {};
+	thumbnail = {};
+	{	QMutexLocker locker( &frame_lock );
+		frames.clear();
+		last_frame = {};
+		delta_bytes = 0;
+		displays[0] = {};
+		displays[1] = {};
+		source.reset();
+		window.clear();
+		source_size = {};
+		prepared_profile = {};
+		preparing_profile = {};
+	}
 	frame_delays.clear();
 	error_msgs.clear();
 	frames_loaded = 0;
+	partial_rows = -1;
 	memory_size = 0;
 	current_status = EMPTY;
 	emit info_loaded();
@@ -48,6 +79,21 @@ void imageCache::set_profile( ColorProfile&& profile ){
 	emit info_loaded();
 }
 
+void imageCache::set_size_hint( QSize size ){
+	size_hint = size;
+	emit info_loaded();
+}
+
+void imageCache::set_thumbnail( QImage preview ){
+	//Keep the most detailed one, when there are several
+	if( preview.width() * preview.height() <= thumbnail.width() * thumbnail.height() )
+		return;
+	
+	memory_size += preview.byteCount() - thumbnail.byteCount();
+	thumbnail = preview;
+	emit thumbnail_loaded();
+}
+
 void imageCache::set_info( unsigned total_frames, bool is_animated, int loops ){
 	current_status = INFO_READY;
 	animate = is_animated;
@@ -56,10 +102,75 @@ void imageCache::set_info( unsigned total_frames, bool is_animated, int loops ){
 	emit info_loaded();
 }
 
-void imageCache::add_frame( QImage frame, unsigned delay ){
+/** Find the bounding box of the pixels which differ, only looking inside 'area' */
+static QRect differingArea( const QImage& a, const QImage& b, QRect area ){
+	int bpp = a.depth() / 8;
+	auto same = [&]( int x, int y, int width ){
+			return std::memcmp( a.constScanLine( y ) + x*bpp, b.constScanLine( y ) + x*bpp, width*bpp ) == 0;
+		};
+	
+	int top = area.top(), bottom = area.bottom();
+	while( top <= bottom && same( area.left(), top, area.width() ) )
+		top++;
+	if( top > bottom )
+		return {};
+	while( same( area.left(), bottom, area.width() ) )
+		bottom--;
+	
+	auto same_column = [&]( int x ){
+			for( int iy=top; iy<=bottom; iy++ )
+				if( !same( x, iy, 1 ) )
+					return false;
+			return true;
+		};
+	int left = area.left(), right = area.right();
+	while( same_column( left ) )
+		left++;
+	while( same_column( right ) )
+		right--;
+	
+	return QRect( QPoint( left, top ), QPoint( right, bottom ) );
+}
+
+/** Store only the area which changed since the last frame, if it is worth it
+ *  @param changed Area which might have changed, or invalid if unknown */
+void imageCache::store_frame( QImage frame, QRect changed ){
+	bool comparable = animate && frame_amount > 1 && partial_rows < 0
+		&&	frame.depth() % 8 == 0
+		&&	last_frame.size() == frame.size()
+		&&	last_frame.format() == frame.format()
+		&&	last_frame.colorTable() == frame.colorTable();
+	
+	StoredFrame stored{ frame, {}, true, unsigned(frames.size()) };
+	if( comparable ){
+		auto area = changed.isValid() ? changed & frame.rect() : frame.rect();
+		area = differingArea( last_frame, frame, area );
+		qint64 area_bytes = qint64( area.width() ) * area.height() * frame.depth() / 8;
+		
+		//Keep a full frame when reconstructing it would be slower than copying one
+		if( delta_bytes + area_bytes < frame.byteCount() ){
+			stored.image = area.isEmpty() ? QImage() : frame.copy( area );
+			stored.offset = area.topLeft();
+			stored.full = false;
+			stored.key = frames.back().key;
+			delta_bytes += area_bytes;
+		}
+	}
+	if( stored.full )
+		delta_bytes = 0;
+	
+	//'frame' is only kept until the next one, unless it was stored in full
+	last_frame = frame;
+	memory_size += stored.image.byteCount();
+	frames.push_back( stored );
+}
+
+void imageCache::add_frame( QImage frame, unsigned delay, QRect changed ){
+	{	QMutexLocker locker( &frame_lock );
+		store_frame( frame, changed );
+		frame_delays.push_back( delay );
+	}
 	frames_loaded++;
-	frames.push_back( frame );
-	frame_delays.push_back( delay );
 	current_status = FRAMES_READY;
 	
 	if( frame_amount < frames_loaded ){
@@ -69,8 +180,224 @@ void imageCache::add_frame( QImage frame, unsigned delay ){
 	emit frame_loaded( frames_loaded-1 );
 }
 
+/** Decode frames on demand using 'frames' instead of adding them
+ *  @param size The size of all the frames
+ *  @param delays The delay of every frame in the animation */
+void imageCache::set_frame_source( std::unique_ptr<AFrameSource> frames, QSize size, std::vector<int> delays ){
+	qint64 frame_bytes = qint64(size.width()) * size.height() * 4;
+	{	QMutexLocker locker( &frame_lock );
+		source = std::move( frames );
+		source_size = size;
+		frame_delays = std::move( delays );
+		
+		//Half of the limit is for the window, the rest is for the keyframes
+		window_size = std::max( memory_limit / 2 / std::max( frame_bytes, qint64(1) ), qint64(2) );
+		window.clear();
+		
+		//Decode the first frame now, so it doesn't delay the GUI
+		window[ 0 ] = source->frame( 0 );
+	}
+	request_frame( 0 ); //Start decoding the following frames
+	
+	frame_amount = frame_delays.size();
+	frames_loaded = frame_amount;
+	memory_size += std::min( qint64(window_size), qint64(frame_amount) ) * frame_bytes;
+	current_status = FRAMES_READY;
+	emit info_loaded();
+	emit frame_loaded( 0 );
+}
+
+QImage imageCache::frame( unsigned int idx ) const{
+	QMutexLocker locker( &frame_lock );
+	if( !source ){
+		if( idx >= frames.size() )
+			return {};
+		if( frames[ idx ].full )
+			return frames[ idx ].image;
+		
+		//Use the buffer not shared with the caller, scanLine() would copy it otherwise
+		auto key = frames[ idx ].key;
+		auto& full = frames[ key ].image;
+		auto usable = [&]( const Display& d ){ return d.index >= int(key) && d.index <= int(idx); };
+		auto writable = []( const Display& d ){ return d.image.isNull() || d.image.isDetached(); };
+		int pick = writable( displays[0] ) ? 0 : 1;
+		if( writable( displays[1-pick] ) && usable( displays[1-pick] )
+			&&	( !usable( displays[pick] ) || displays[1-pick].index > displays[pick].index ) )
+			pick = 1 - pick; //Both can be written, take the one closest to 'idx'
+		auto& display = displays[ pick ];
+		
+		//Continue from the frame it contains when playing, otherwise start from the full frame
+		int bpp = full.depth() / 8;
+		if( !usable( display ) ){
+			if( display.image.isDetached() && display.image.size() == full.size()
+				&&	display.image.format() == full.format() && display.image.colorTable() == full.colorTable() ){
+				for( int iy=0; iy<full.height(); iy++ )
+					std::memcpy( display.image.scanLine( iy ), full.constScanLine( iy ), full.width() * bpp );
+			}
+			else
+				display.image = full; //Detaches when changed
+			display.index = key;
+		}
+		
+		for( unsigned i=display.index+1; i<=idx; i++ ){
+			auto& patch = frames[ i ].image;
+			for( int iy=0; iy<patch.height(); iy++ )
+				std::memcpy(
+						display.image.scanLine( iy + frames[ i ].offset.y() ) + frames[ i ].offset.x() * bpp
+					,	patch.constScanLine( iy ), patch.width() * bpp
+					);
+		}
+		display.index = idx;
+		return display.image;
+	}
+	if( idx >= frame_delays.size() )
+		return {};
+	
+	auto it = window.find( idx );
+	return it != window.end() ? it->second : QImage();
+}
+
+bool imageCache::request_frame( unsigned int idx ){
+	QMutexLocker locker( &frame_lock );
+	if( !source )
+		return true;
+	
+	wanted_frame = idx;
+	if( !decoding && !stop_decoding ){
+		decoding = true;
+		decoder = QtConcurrent::run( this, &imageCache::decode_ahead );
+	}
+	return window.count( idx ) > 0;
+}
+
+/** Keep the frames from 'wanted_frame' and forward in the window */
+void imageCache::decode_ahead(){
+	const unsigned max_ahead = 16;
+	while( !stop_decoding ){
+		unsigned idx = 0, wanted = 0, count = 0;
+		bool missing = false;
+		{	QMutexLocker locker( &frame_lock );
+			wanted = wanted_frame;
+			count = frame_delays.size();
+			auto ahead = std::min( std::max( window_size, 2u ) - 1, max_ahead );
+			for( unsigned i=0; i<ahead && i<count && !missing; i++ ){
+				idx = ( wanted + i ) % count;
+				missing = window.count( idx ) == 0;
+			}
+			if( !missing ){
+				decoding = false;
+				return;
+			}
+		}
+		
+		//Only this thread uses 'source', and reset() waits for it before removing it
+		auto image = source->frame( idx );
+		
+		{	QMutexLocker locker( &frame_lock );
+			//Make room by dropping the frame which will be needed last when playing forward
+			auto distance = [&]( unsigned frame ){ return ( frame + count - wanted_frame ) % count; };
+			if( window.size() >= window_size ){
+				auto last = std::max_element( window.begin(), window.end()
+					,	[&]( const auto& a, const auto& b ){ return distance( a.first ) < distance( b.first ); } );
+				window.erase( last );
+			}
+			window[ idx ] = image;
+		}
+		emit frame_decoded( idx );
+	}
+	
+	QMutexLocker locker( &frame_lock );
+	decoding = false;
+}
+
+QSize imageCache::frame_size( unsigned int idx ) const{
+	QMutexLocker locker( &frame_lock );
+	if( source )
+		return idx < frame_delays.size() ? source_size : QSize();
+	if( idx >= frames.size() )
+		return {};
+	return frames[ frames[ idx ].key ].image.size();
+}
+
+void imageCache::add_partial_frame( QImage frame, unsigned delay ){
+	partial_rows = 0;
+	partial_timer.start();
+	add_frame( frame, delay );
+}
+
+void imageCache::set_partial_progress( int rows_done ){
+	partial_rows = rows_done;
+	
+	//Limit the amount of repaints, as each one needs to redraw the image
+	if( partial_timer.elapsed() >= 40 ){
+		partial_timer.restart();
+		emit frame_updated( frames_loaded-1 );
+	}
+}
+
+void imageCache::finish_partial_pass(){
+	partial_rows = frames.back().image.height();
+	partial_timer.restart();
+	emit frame_updated( frames_loaded-1 );
+}
+
+void imageCache::finish_partial_frame(){
+	partial_rows = -1;
+	emit frame_updated( frames_loaded-1 );
+}
+
 void imageCache::set_fully_loaded(){
+	QMutexLocker locker( &frame_lock );
+	last_frame = {};
 	current_status = LOADED;
 }
 
+/** Convert a still image to the profile of 'monitor', replacing the decoded frame.
+ *  Slow, so it should be done in another thread. Orientation is left to the viewer,
+ *  as it can be drawn rotated without touching the pixels. */
+void imageCache::prepare( unsigned monitor ){
+	auto profile_id = manager->output_id( monitor );
+	QImage img;
+	{	QMutexLocker locker( &frame_lock );
+		if( current_status != LOADED || !is_still() || partial_rows >= 0 || frames.empty() )
+			return;
+		//Only once, the loader and another thread might both ask for it
+		if( !prepared_profile.isEmpty() || !preparing_profile.isEmpty() )
+			return;
+		preparing_profile = profile_id;
+		img = frames[0].image;
+	}
+	
+	manager->doTransform( img, profile, monitor );
+	
+	//The fastest format to paint
+	if( img.format() != QImage::Format_RGB32 && img.format() != QImage::Format_ARGB32_Premultiplied )
+		img = img.convertToFormat( img.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32 );
+	
+	{	QMutexLocker locker( &frame_lock );
+		memory_size += img.byteCount() - frames[0].image.byteCount();
+		frames[0].image = img;
+		prepared_profile = profile_id;
+		preparing_profile = {};
+	}
+	emit frame_prepared();
+}
+
+void imageCache::finish_prepare(){
+	if( prepare_pending.exchange( false ) )
+		emit frame_prepared();
+}
+
+QImage imageCache::prepared_frame( unsigned int idx, QByteArray profile ) const{
+	QMutexLocker locker( &frame_lock );
+	if( idx != 0 || prepared_profile.isEmpty() || prepared_profile != profile || frames.empty() )
+		return {};
+	return frames[0].image;
+}
+
+QByteArray imageCache::get_prepared_profile() const{
+	QMutexLocker locker( &frame_lock );
+	return prepared_profile;
+}
+
 
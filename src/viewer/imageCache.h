@@ -20,11 +20,18 @@
 
 #include "colorManager.h"
 #include "Orientation.hpp"
+#include "FrameSource.hpp"
 
 #include <QObject>
 #include <QImage>
 #include <QStringList>
 #include <QUrl>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QFuture>
+#include <atomic>
+#include <map>
+#include <memory>
 #include <vector>
 
 class colorManager;
@@ -35,22 +42,71 @@ class imageCache: public QObject{
 	private:
 		void init();
 		static colorManager* manager;
+		static qint64 memory_limit;
 		
 	private:
 	//Variables containing info about the image(s)
 		ColorProfile profile;
 		
 		int frame_amount{ 0 };
-		std::vector<QImage> frames;
 		int frames_loaded{ 0 };
 		
+		//Animation frames usually only change a small area, so only that area is stored.
+		//Every frame can be reconstructed by applying the changes to the last full frame.
+		struct StoredFrame{
+			QImage image;	//Either the full frame or the changed area, null if unchanged
+			QPoint offset;	//Position of the changed area
+			bool full;
+			unsigned key;	//Index of the full frame this frame is based on
+		};
+		std::vector<StoredFrame> frames;
+		QImage last_frame;	//Frame to compare with when adding the next
+		qint64 delta_bytes{ 0 };	//Size of the changed areas since the last full frame
+		//Reconstructed frames. The caller keeps the one returned last, so the other one
+		//can be written to without detaching it while playing.
+		struct Display{
+			QImage image;
+			int index{ -1 };	//Frame it contains
+		};
+		mutable Display displays[2];
+		void store_frame( QImage frame, QRect changed );
+		
+		//Animations too large to keep in memory are decoded on demand, only a window
+		//of frames are kept. The frames following the wanted one are decoded on another
+		//thread, so the GUI never waits on the decoder.
+		std::unique_ptr<AFrameSource> source;
+		std::map<unsigned, QImage> window;
+		unsigned window_size{ 0 };
+		QSize source_size;
+		unsigned wanted_frame{ 0 };
+		bool decoding{ false };
+		QFuture<void> decoder;
+		std::atomic<bool> stop_decoding{ false };
+		mutable QMutex frame_lock;
+		void decode_ahead();
+		void stop_decoder();
+		
+		//Still images are converted to the monitor profile when loaded, so the viewer only
+		//needs to draw them. The converted frame replaces the decoded one, so it can't be
+		//converted for another profile afterwards. Guarded by 'frame_lock'.
+		QByteArray prepared_profile;	//colorManager::output_id() it was converted to, empty if not
+		QByteArray preparing_profile;	//Profile currently being prepared for, empty if none
+		std::atomic<bool> prepare_pending{ false };	//The loader will call prepare() once decoded
+		
+		//Progress of the last frame, if it is still being decoded
+		std::atomic<int> partial_rows{ -1 };	//-1 if not partial
+		QElapsedTimer partial_timer;
+		
 		bool animate{ false };
 		std::vector<int> frame_delays;
 		int loop_amount{ 0 };	//Amount of times the loop should continue looping
 		
 		Orientation orientation;
+		QSize size_hint;	//Size read from the header, available before any frames
+		QSize full_size;	//Size before decoding at a reduced resolution, invalid if not reduced
+		QImage thumbnail;	//Embedded preview, shown until the first frame is ready
 		
-		long memory_size{ 0 };
+		std::atomic<qint64> memory_size{ 0 };	//Bytes used by the decoded frames
 		
 	//Info about loading
 	public:
@@ -74,7 +130,6 @@ class imageCache: public QObject{
 		
 		void reset();
 		
-		QImage thumbnail;
 		QStringList error_msgs;
 		
 	public:
@@ -87,14 +142,36 @@ class imageCache: public QObject{
 			add_frame( img, 0 );
 			set_fully_loaded();
 		}
+		~imageCache();
 		
 		void set_profile( ColorProfile&& profile );
 		void set_info( unsigned total_frames, bool is_animated=false, int loops=0 );
 		void set_orientation( Orientation orientation ){ this->orientation = orientation; }
-		void add_frame( QImage frame, unsigned delay );
+		void set_size_hint( QSize size );
+		void set_scaled( QSize original ){ full_size = original; }
+		void set_thumbnail( QImage preview );
+		void add_frame( QImage frame, unsigned delay, QRect changed=QRect() );
+		void set_frame_source( std::unique_ptr<AFrameSource> frames, QSize size, std::vector<int> delays );
 		void set_fully_loaded();
+		void prepare( unsigned monitor );
+		void expect_prepare(){ prepare_pending = true; }
+		void finish_prepare();	//Whether or not prepare() did anything
+		bool is_prepare_pending() const{ return prepare_pending; }
+		bool is_still() const{ return frame_amount == 1 && !animate && !source; }
+		
+		//Progressive loading. The reader must keep writing to the memory of 'frame'
+		//without detaching it, i.e. get the scanLine() pointers before adding it.
+		void add_partial_frame( QImage frame, unsigned delay );
+		void set_partial_progress( int rows_done );
+		void finish_partial_pass();	//The whole frame can be shown, but it will be refined further
+		void finish_partial_frame();
+		
+		qint64 get_memory_size() const{ return memory_size; }
 		
-		long get_memory_size() const{ return memory_size; }	//Notice, this is a rough number, not accurate!
+		//Animations using more than this amount of bytes should use set_frame_source()
+		static void set_memory_limit( qint64 bytes ){ memory_limit = bytes; }
+		static qint64 get_memory_limit(){ return memory_limit; }
+		bool is_streamed() const{ return source != nullptr; }
 		
 		//Animation info
 		bool is_animated() const{ return animate; }
@@ -102,17 +179,36 @@ class imageCache: public QObject{
 		
 		//Meta data
 		Orientation get_orientation() const{ return orientation; }
+		QSize get_size_hint() const{ return size_hint; }
+		bool is_scaled() const{ return full_size.isValid(); }	//Decoded at a lower resolution than the file
+		QSize original_size() const{ return full_size; }
+		QImage get_thumbnail() const{ return thumbnail; }
 		const ColorProfile& get_profile() const{ return profile; }
-		colorManager* get_manager() const{ return manager; }
+		static colorManager* get_manager(){ return manager; }
 		
 		//Frame info
 		int frame_count() const{ return frame_amount; }
-		QImage frame( unsigned int idx ) const{ return idx < frames.size() ? frames[ idx ] : QImage(); }
-		int frame_delay( unsigned int idx ) const{ return idx < frames.size() ? frame_delays[ idx ] : 0; } //How long a frame should be shown
+		QImage frame( unsigned int idx ) const;	//Null if a streamed frame is not decoded yet
+		/** Ask for a frame to be shown soon, for streamed animations it and the following
+		 *  frames are decoded in the background and frame_decoded() is emitted for each.
+		 *  @return true if frame( idx ) is available now */
+		bool request_frame( unsigned int idx );
+		QSize frame_size( unsigned int idx ) const;	//Same as frame(idx).size(), without decoding it
+		/** @return The frame converted for 'profile', null if not prepared for it */
+		QImage prepared_frame( unsigned int idx, QByteArray profile ) const;
+		/** @return The profile frame( 0 ) was converted to by prepare(), empty if it is as decoded */
+		QByteArray get_prepared_profile() const;
+		bool is_partial( unsigned int idx ) const{ return partial_rows >= 0 && idx+1 == unsigned(frames_loaded); }
+		int partial_rows_done() const{ return partial_rows; } //Rows from the top which can be shown
+		int frame_delay( unsigned int idx ) const{ return idx < frame_delays.size() ? frame_delays[ idx ] : 0; } //How long a frame should be shown
 	
 	signals:
 		void info_loaded();
+		void thumbnail_loaded();
 		void frame_loaded( unsigned int idx );
+		void frame_updated( unsigned int idx );	//More rows of a partial frame are ready
+		void frame_prepared();	//prepared_frame() is ready, or it will not be prepared after all
+		void frame_decoded( unsigned int idx );	//A streamed frame is now available
 };
 
 
@@ -55,6 +55,7 @@ using S = ViewerSettings;
 imageViewer::imageViewer( QSettings& settings, QWidget* parent ): QWidget( parent ), settings( settings ){
 	//User settings
 	initial_resize = S(settings).initial_resize();
+	prepare_frames = settings.value( "loading/prepare-frames", true ).toBool();
 	
 	button_rleft   = translate_button( "mouse/rocker-left",  'L' );
 	button_rright  = translate_button( "mouse/rocker-right", 'R' );
@@ -101,15 +102,43 @@ QImage imageViewer::get_frame(){
 		return {};
 	
 	int current_monitor = QApplication::desktop()->screenNumber( this );
+	if( shown_monitor != current_monitor ){
+		shown_monitor = current_monitor;
+		emit monitor_changed( current_monitor );
+	}
+	
 	if( converted_monitor != current_monitor ){
 		//Cache invalid, refresh
+		auto image_orientation = image_cache->get_orientation();
+		auto profile = image_cache->get_manager()->output_id( current_monitor );
+		auto prepared = image_cache->prepared_frame( current_frame, profile );
+		converted_monitor = current_monitor;
+		if( !prepared.isNull() ){
+			//Colors already converted by the loader
+			converted = prepared;
+			updateOrientation( orientation.add(image_orientation), {} );
+			return converted;
+		}
+		
+		//Not prepared for this monitor, so convert it here
 		converted = image_cache->frame( current_frame );
+		if( converted.isNull() ){
+			//A streamed frame which is no longer in the window
+			converted_monitor = -1;
+			image_cache->request_frame( current_frame );
+			return converted;
+		}
 		
-		//Transform colors to current monitor profile
-		image_cache->get_manager()->doTransform( converted, image_cache->get_profile(), current_monitor );
-		converted_monitor = current_monitor;
+		//Transform colors to current monitor profile, unless it was prepared for another
+		//monitor. fileManager loads it again for this one then.
+		if( image_cache->get_prepared_profile().isEmpty() )
+			image_cache->get_manager()->doTransform( converted, image_cache->get_profile(), current_monitor );
+		
+		updateOrientation( orientation.add(image_orientation), {} );
 		
-		updateOrientation( orientation.add(image_cache->get_orientation()), {} );
+		//Paletted images are kept small in the cache, but are slow to paint
+		if( converted.format() == QImage::Format_Indexed8 )
+			converted = converted.convertToFormat( QImage::Format_ARGB32_Premultiplied );
 	}
 	
 	return converted;
@@ -118,7 +147,12 @@ QImage imageViewer::get_frame(){
 QSize imageViewer::frameSize( unsigned index ) const{
 	if( image_cache ){
 		auto orient = orientation.add(image_cache->get_orientation());
-		return orient.finalSize( image_cache->frame(index).size() );
+		auto size = image_cache->frame_size( index );
+		if( image_cache->is_scaled() )
+			size = image_cache->original_size(); //Lay it out as the full image
+		if( size.isEmpty() )
+			size = image_cache->get_size_hint(); //Not loaded yet
+		return orient.finalSize( size );
 	}
 	else
 		return {};
@@ -131,7 +165,6 @@ bool imageViewer::can_animate() const{
 void imageViewer::change_frame( int wanted ){
 	if( !image_cache )
 		return;
-	clear_converted();
 	
 	//Cycle backwards
 	if( wanted < 0 )
@@ -147,22 +180,30 @@ void imageViewer::change_frame( int wanted ){
 		return;	//Not loaded
 	
 	//Go to next frame
-	current_frame = wanted;
-	if( current_frame >= frame_amount ){
+	if( wanted >= frame_amount ){
 		//Last frame reached
 		if( loop_counter > 0 ){
 			//Reduce counter by one
-			current_frame = 0;
+			wanted = 0;
 			loop_counter--;
 		}
 		else if( loop_counter == -1 )
-			current_frame = 0; //Repeat forever
+			wanted = 0; //Repeat forever
 		else{
 			continue_animating = false;	//Stop looping
-			current_frame--;
+			wanted = frame_amount - 1;
 		}
 	}
 	
+	//Streamed frames are decoded in the background, keep showing the current one meanwhile
+	if( !image_cache->request_frame( wanted ) ){
+		waiting_on_frame = wanted;
+		return;
+	}
+	
+	clear_converted();
+	current_frame = wanted;
+	
 	
 	if( continue_animating ){
 		int delay = image_cache->frame_delay( current_frame );
@@ -260,6 +301,10 @@ void imageViewer::read_info(){
 	loop_counter = image_cache->loop_count();
 	continue_animating = image_cache->is_animated();
 	
+	//Lay out the image already, if the dimensions are known before any frames
+	if( image_cache->loaded() == 0 && image_cache->get_size_hint().isValid() )
+		init_size();
+	
 	emit image_info_read();
 }
 void imageViewer::check_frame( unsigned int idx ){
@@ -275,6 +320,20 @@ void imageViewer::check_frame( unsigned int idx ){
 	}
 }
 
+void imageViewer::frame_decoded( unsigned int idx ){
+	if( waiting_on_frame >= 0 && idx == (unsigned int)waiting_on_frame ){
+		waiting_on_frame = -1;
+		change_frame( idx );
+	}
+}
+
+void imageViewer::frame_updated( unsigned int idx ){
+	if( idx == (unsigned int)current_frame ){
+		clear_converted();
+		update();
+	}
+}
+
 void imageViewer::init_size(){
 	//TODO: customize
 	if( initial_resize )
@@ -299,11 +358,14 @@ void imageViewer::change_image( std::shared_ptr<imageCache> new_image ){
 	
 	image_cache = std::move(new_image);
 	waiting_on_frame = -1;
+	full_requested = false;
 	current_frame = 0;
 	frame_amount = 0;
 	clear_converted();
 	
 	if( image_cache ){
+		connect( image_cache.get(), SIGNAL( frame_prepared() ), this, SLOT( update() ) );
+		connect( image_cache.get(), SIGNAL( frame_decoded(unsigned int) ), this, SLOT( frame_decoded(unsigned int) ) );
 		switch( image_cache->get_status() ){
 			case imageCache::INVALID:	break; //Loading failed
 			
@@ -311,12 +373,16 @@ void imageViewer::change_image( std::shared_ptr<imageCache> new_image ){
 			case imageCache::EMPTY:
 					connect( image_cache.get(), SIGNAL( info_loaded() ), this, SLOT( read_info() ) );
 					connect( image_cache.get(), SIGNAL( frame_loaded(unsigned int) ), this, SLOT( check_frame(unsigned int) ) );
+					connect( image_cache.get(), SIGNAL( frame_updated(unsigned int) ), this, SLOT( frame_updated(unsigned int) ) );
+					connect( image_cache.get(), SIGNAL( thumbnail_loaded() ), this, SLOT( update() ) );
 				break;
 			
 			case imageCache::INFO_READY:
 			case imageCache::FRAMES_READY:
 					connect( image_cache.get(), SIGNAL( info_loaded() ), this, SLOT( read_info() ) );
 					connect( image_cache.get(), SIGNAL( frame_loaded(unsigned int) ), this, SLOT( check_frame(unsigned int) ) );
+					connect( image_cache.get(), SIGNAL( frame_updated(unsigned int) ), this, SLOT( frame_updated(unsigned int) ) );
+					connect( image_cache.get(), SIGNAL( thumbnail_loaded() ), this, SLOT( update() ) );
 					read_info();
 				break;
 			
@@ -365,18 +431,27 @@ void imageViewer::paintEvent( QPaintEvent* ){
 	
 	if( !image_cache || image_cache->get_status() == imageCache::EMPTY ){
 		//We have nothing to display
+		shown = {};
 		draw_message( &txt_no_image );
 		return;
 	}
 	
 	if( image_cache->get_status() == imageCache::INVALID ){
 		//Image could not be loaded
+		shown = {};
 		draw_message( &txt_invalid );
 		return;
 	}
 	if( current_frame >= image_cache->loaded() ){
-		//Image is currently loading
-		draw_message( &txt_loading );
+		//Image is currently loading, show the embedded preview if there is one
+		shown = {};
+		if( thumbnail_visible() ){
+			QPainter painter( this );
+			painter.setRenderHints( QPainter::SmoothPixmapTransform, true );
+			draw_thumbnail( painter );
+		}
+		else
+			draw_message( &txt_loading );
 		return;
 	}
 	
@@ -386,15 +461,135 @@ void imageViewer::paintEvent( QPaintEvent* ){
 	if( zoom.scale() <= 1.5 || S(settings).smooth_scaling() )
 		painter.setRenderHints( QPainter::SmoothPixmapTransform, true );
 	
-	painter.drawImage( zoom.area(), get_frame() );
+	if( image_cache->is_partial( current_frame ) ){
+		shown = {};
+		if( thumbnail_visible() )
+			draw_thumbnail( painter );
+		draw_partial( painter );
+	}
+	else if( !frame_ready() && !shown.isNull() )
+		draw_frame( painter, shown, shown_transform ); //Keep the last image until this one is prepared
+	else{
+		//Prepared frames are drawn rotated by the painter, so no pixels are touched here
+		auto prepared = prepared_frame();
+		if( !prepared.isNull() )
+			draw_frame( painter, prepared, image_transform( prepared.size() ) );
+		else{
+			auto img = get_frame();
+			auto area = zoom.area();
+			auto scale = QTransform::fromScale( area.width() / (double)img.width(), area.height() / (double)img.height() );
+			draw_frame( painter, img, scale * QTransform::fromTranslate( area.x(), area.y() ) );
+		}
+	}
+	
+	check_resolution();
+}
+
+/** Ask for the full image once it is shown larger than the reduced one */
+void imageViewer::check_resolution(){
+	if( full_requested || !image_cache->is_scaled() || image_cache->is_partial( current_frame ) )
+		return;
+	
+	auto orient = orientation.add( image_cache->get_orientation() );
+	auto decoded = orient.finalSize( image_cache->frame( current_frame ).size() );
+	auto shown = zoom.area().size() * devicePixelRatioF(); //The decoded pixels are physical pixels
+	if( shown.width() > decoded.width() || shown.height() > decoded.height() ){
+		full_requested = true;
+		emit full_resolution_wanted();
+	}
+}
+
+/** @return Transformation of an image of 'image_size' in the orientation of
+ *  the file to the viewing area */
+QTransform imageViewer::image_transform( QSize image_size ) const{
+	//Map the image onto its orientated size
+	auto orient = orientation.add( image_cache->get_orientation() ).normalized();
+	QSize size = orient.finalSize( image_size );
+	QTransform transform;
+	if( orient.rotation == 1 )
+		transform = QTransform( 0, 1, -1, 0, image_size.height(), 0 ); //Rotate right
+	if( orient.flip_hor )
+		transform *= QTransform( -1, 0, 0, 1, size.width(), 0 );
+	if( orient.flip_ver )
+		transform *= QTransform( 1, 0, 0, -1, 0, size.height() );
+	
+	//Scale it to the viewing area
+	auto area = zoom.area();
+	transform *= QTransform::fromScale( area.width() / (double)size.width(), area.height() / (double)size.height() );
+	transform *= QTransform::fromTranslate( area.x(), area.y() );
+	return transform;
+}
+
+/** The preview can be shown when the layout of the image is known */
+bool imageViewer::thumbnail_visible() const{
+	return current_frame == 0
+		&&	!image_cache->get_thumbnail().isNull()
+		&&	frameSize( 0 ).isValid();
+}
+
+/** Draws the embedded preview scaled up to the size of the image */
+void imageViewer::draw_thumbnail( QPainter& painter ){
+	auto thumbnail = image_cache->get_thumbnail();
+	painter.save();
+	painter.setTransform( image_transform( thumbnail.size() ) );
+	painter.drawImage( 0, 0, thumbnail );
+	painter.restore();
+}
+
+/** @return false while the loader is still preparing the still image, see imageCache::prepare() */
+bool imageViewer::frame_ready(){
+	int current_monitor = QApplication::desktop()->screenNumber( this );
+	if( !prepare_frames || !image_cache->is_still() || converted_monitor == current_monitor )
+		return true; //Animations are converted per frame in get_frame()
+	
+	if( shown_monitor != current_monitor ){
+		shown_monitor = current_monitor;
+		emit monitor_changed( current_monitor ); //Images for another profile are loaded again
+	}
+	return !prepared_frame().isNull() || !image_cache->is_prepare_pending();
+}
+
+/** @return The current frame if the loader converted it for this monitor, otherwise null */
+QImage imageViewer::prepared_frame() const{
+	if( !prepare_frames )
+		return {};
+	auto profile = image_cache->get_manager()->output_id( QApplication::desktop()->screenNumber( this ) );
+	return image_cache->prepared_frame( current_frame, profile );
+}
+
+/** Draws a complete frame and remembers it, so it can be kept while the next one is prepared */
+void imageViewer::draw_frame( QPainter& painter, QImage img, QTransform transform ){
+	if( img.isNull() )
+		return;
+	painter.save();
+	painter.setTransform( transform );
+	painter.drawImage( 0, 0, img );
+	painter.restore();
+	shown = img;
+	shown_transform = transform;
+}
+
+/** Draws the part of a frame which have been decoded so far.
+ *  Orientation is done by the painter instead of transforming the image, and
+ *  the image is not color managed, as it would have to be redone for every
+ *  update. The managed version replaces it once the frame is complete. */
+void imageViewer::draw_partial( QPainter& painter ){
+	auto img = image_cache->frame( current_frame );
+	auto rows = image_cache->partial_rows_done();
+	if( rows <= 0 )
+		return;
+	
+	painter.setTransform( image_transform( img.size() ) );
+	painter.setClipRect( 0, 0, img.width(), rows );
+	painter.drawImage( 0, 0, img );
 }
 
 QSize imageViewer::sizeHint() const{
-	if( !image_cache || image_cache->loaded() < 1 )
+	if( !image_cache || ( image_cache->loaded() < 1 && !image_cache->get_size_hint().isValid() ) )
 		return QSize();
 		
 	QSize size;
-	if( image_cache->is_animated() )
+	if( image_cache->is_animated() || image_cache->loaded() < 1 )
 		size = frameSize( 0 ); //Just return the first frame
 	else{
 		//Iterate over all frames and find the largest
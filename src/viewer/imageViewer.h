@@ -31,6 +31,8 @@
 class imageCache;
 
 class QStaticText;
+class QPainter;
+class QTransform;
 
 class imageViewer: public QWidget{
 	Q_OBJECT
@@ -42,6 +44,8 @@ class imageViewer: public QWidget{
 		int loop_counter{ 0 };
 		bool continue_animating{ false };
 		int waiting_on_frame{ -1 };
+		bool full_requested{ false };
+		void check_resolution();
 	public:
 		int get_frame_amount() const{ return frame_amount; }
 		int get_current_frame() const{ return current_frame; }
@@ -52,10 +56,16 @@ class imageViewer: public QWidget{
 	private:
 		QImage converted;
 		int converted_monitor{ -1 };
+		int shown_monitor{ -1 };	//Last monitor the image was drawn on
+		bool prepare_frames;	//Still images are converted in the background, see imageCache::prepare()
 		void clear_converted(){
 			converted = QImage();
 			converted_monitor = -1;
 		}
+		
+		//Last frame drawn, kept while the next image is being prepared
+		QImage shown;
+		QTransform shown_transform;
 	
 	//How the image is to be viewed
 	private:
@@ -81,6 +91,8 @@ class imageViewer: public QWidget{
 	private slots:
 		void read_info();
 		void check_frame( unsigned int idx );
+		void frame_updated( unsigned int idx );
+		void frame_decoded( unsigned int idx );
 	private slots:
 		void change_frame( int frame );
 		void next_frame(){ change_frame( current_frame + 1 ); }
@@ -100,6 +112,13 @@ class imageViewer: public QWidget{
 	protected:
 		void updateOrientation( Orientation wanted, Orientation current );
 		void draw_message( QStaticText* text );
+		QTransform image_transform( QSize image_size ) const;
+		bool thumbnail_visible() const;
+		void draw_thumbnail( QPainter& painter );
+		void draw_partial( QPainter& painter );
+		bool frame_ready();
+		QImage prepared_frame() const;
+		void draw_frame( QPainter& painter, QImage img, QTransform transform );
 		void paintEvent( QPaintEvent* );
 		void resizeEvent( QResizeEvent* ){ updateView(); }
 	
@@ -144,6 +163,8 @@ class imageViewer: public QWidget{
 	signals:
 		void image_info_read();
 		void resize_wanted();
+		void full_resolution_wanted();	//Zoomed in past the resolution the image was decoded at
+		void monitor_changed( int monitor );	//Images should be prepared for another monitor
 		void image_changed();
 		void double_clicked();
 		void rocker_left();